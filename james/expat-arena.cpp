@@ -0,0 +1,225 @@
+#include "expat-arena.hpp"
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+
+namespace james {
+
+  namespace {
+    // Every block starts with a header recording its owner (nullptr for blocks that
+    // came from the system allocator) & size. The union keeps the payload aligned.
+    union BlockHeader {
+      struct {
+        ExpatArena* arena;
+        size_t size;
+      } info;
+      std::max_align_t align;
+    };
+
+    const size_t ALIGNMENT = alignof(BlockHeader);
+
+    size_t RoundUp(size_t n) {
+      return (n + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+    }
+
+    BlockHeader* HeaderOf(void* p) {
+      return static_cast<BlockHeader*>(p) - 1;
+    }
+
+    thread_local ExpatArena* currentArena = nullptr;
+  }
+
+  const XML_Memory_Handling_Suite ExpatArena::MemorySuite = {
+    ExpatArena::SuiteMalloc, ExpatArena::SuiteRealloc, ExpatArena::SuiteFree
+  };
+
+  ExpatArena::Scope::Scope(ExpatArena* arena)
+    : previous_(currentArena)
+  {
+    if (arena) {
+      currentArena = arena;
+    }
+  }
+
+  ExpatArena::Scope::~Scope() {
+    currentArena = previous_;
+  }
+
+  ExpatArena::ExpatArena(size_t chunkSize, size_t maxBytes)
+    : chunkSize_(RoundUp(std::max(chunkSize, (size_t) 1024))), maxBytes_(maxBytes), used_(0),
+      currentChunk_(0), offset_(0)
+  {
+  }
+
+  ExpatArena::~ExpatArena() {
+    for (auto& c : chunks_) {
+      std::free(c.data);
+    }
+  }
+
+  void ExpatArena::Release() {
+    // Keep standard sized chunks for the next document but give oversized ones
+    // (allocated for unusually large blocks) back to the system.
+    auto i = std::remove_if(chunks_.begin(), chunks_.end(), [this](const Chunk& c) {
+      if (c.size > chunkSize_) {
+        std::free(c.data);
+        return true;
+      }
+      return false;
+    });
+    chunks_.erase(i, chunks_.end());
+
+    used_ = 0;
+    currentChunk_ = 0;
+    offset_ = 0;
+  }
+
+  void* ExpatArena::Allocate(size_t size) {
+    const size_t blockSize = sizeof(BlockHeader) + RoundUp(size);
+
+    if (maxBytes_ && used_ + blockSize > maxBytes_) {
+      return nullptr;
+    }
+
+    // Find room in the current chunk, then in any retained chunks, and only then
+    // ask the system for a new one.
+    while (currentChunk_ < chunks_.size() && offset_ + blockSize > chunks_[currentChunk_].size) {
+      ++currentChunk_;
+      offset_ = 0;
+    }
+
+    if (currentChunk_ == chunks_.size()) {
+      Chunk c;
+      c.size = std::max(chunkSize_, blockSize);
+      c.data = static_cast<char*>(std::malloc(c.size));
+
+      if (!c.data) {
+        return nullptr;
+      }
+
+      chunks_.push_back(c);
+      offset_ = 0;
+    }
+
+    BlockHeader* header = reinterpret_cast<BlockHeader*>(chunks_[currentChunk_].data + offset_);
+    header->info.arena = this;
+    header->info.size = RoundUp(size);
+
+    offset_ += blockSize;
+    used_ += blockSize;
+
+    return header + 1;
+  }
+
+  bool ExpatArena::IsTop(void* p) const {
+    if (currentChunk_ == chunks_.size()) {
+      return false;
+    }
+
+    // p may be in an earlier chunk, and comparing pointers into different allocations
+    // with < isn't defined (std::less is), so check it's in the current chunk & then
+    // compare offsets
+    const Chunk& chunk = chunks_[currentChunk_];
+    const char* block = static_cast<const char*>(p);
+    const std::less<const char*> before;
+
+    if (before(block, chunk.data) || !before(block, chunk.data + chunk.size)) {
+      return false;
+    }
+
+    return (size_t) (block - chunk.data) + HeaderOf(p)->info.size == offset_;
+  }
+
+  void* ExpatArena::Reallocate(void* p, size_t size) {
+    BlockHeader* header = HeaderOf(p);
+    const size_t oldSize = header->info.size;
+    const size_t newSize = RoundUp(size);
+
+    // The most recent block can simply be resized where it is
+    if (IsTop(p)) {
+      const size_t newOffset = offset_ - oldSize + newSize;
+      const size_t newUsed = used_ - oldSize + newSize;
+
+      if (newOffset <= chunks_[currentChunk_].size && (!maxBytes_ || newUsed <= maxBytes_)) {
+        offset_ = newOffset;
+        used_ = newUsed;
+        header->info.size = newSize;
+        return p;
+      }
+    }
+
+    void* q = Allocate(size);
+
+    if (q) {
+      std::memcpy(q, p, std::min(oldSize, newSize));
+      Free(p);
+    }
+
+    return q;
+  }
+
+  void ExpatArena::Free(void* p) {
+    if (IsTop(p)) {
+      const size_t blockSize = sizeof(BlockHeader) + HeaderOf(p)->info.size;
+      offset_ -= blockSize;
+      used_ -= blockSize;
+    }
+  }
+
+  void* ExpatArena::SuiteMalloc(size_t size) {
+    if (currentArena) {
+      return currentArena->Allocate(size);
+    }
+
+    BlockHeader* header = static_cast<BlockHeader*>(std::malloc(sizeof(BlockHeader) + size));
+
+    if (!header) {
+      return nullptr;
+    }
+
+    header->info.arena = nullptr;
+    header->info.size = size;
+
+    return header + 1;
+  }
+
+  void* ExpatArena::SuiteRealloc(void* p, size_t size) {
+    if (!p) {
+      return SuiteMalloc(size);
+    }
+
+    BlockHeader* header = HeaderOf(p);
+
+    if (header->info.arena) {
+      return header->info.arena->Reallocate(p, size);
+    }
+
+    header = static_cast<BlockHeader*>(std::realloc(header, sizeof(BlockHeader) + size));
+
+    if (!header) {
+      return nullptr;
+    }
+
+    header->info.size = size;
+
+    return header + 1;
+  }
+
+  void ExpatArena::SuiteFree(void* p) {
+    if (!p) {
+      return;
+    }
+
+    BlockHeader* header = HeaderOf(p);
+
+    if (header->info.arena) {
+      header->info.arena->Free(p);
+    }
+    else {
+      std::free(header);
+    }
+  }
+
+} // james
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <expat.h>
+#include <cstddef>
+#include <vector>
+
+namespace james {
+
+  //
+  // Bump allocator used as the Expat memory suite by arena-backed ExpatParsers.
+  //
+  // Expat's memory callbacks receive no user data so:
+  // - malloc goes to whichever arena has been made current on this thread by a Scope
+  //   (or to the system allocator if there is none).
+  // - realloc & free find the owning arena from a small header before each block.
+  //
+  // free() only reclaims the most recent allocation; everything else is reclaimed in
+  // one shot by Release(), which keeps the chunks for the next document.
+  //
+  struct ExpatArena {
+    struct Scope {
+      explicit Scope(ExpatArena* arena);
+      ~Scope();
+
+      Scope(const Scope&) = delete;
+      Scope& operator =(const Scope&) = delete;
+
+    private:
+      ExpatArena* previous_;
+    };
+
+    // maxBytes == 0 means no limit
+    ExpatArena(size_t chunkSize, size_t maxBytes);
+    ~ExpatArena();
+
+    ExpatArena(const ExpatArena&) = delete;
+    ExpatArena& operator =(const ExpatArena&) = delete;
+
+    void Release();
+
+    size_t BytesUsed() const { return used_; }
+
+    static const XML_Memory_Handling_Suite MemorySuite;
+
+  private:
+    struct Chunk {
+      char* data;
+      size_t size;
+    };
+
+    size_t chunkSize_;
+    size_t maxBytes_;
+    size_t used_;
+
+    std::vector<Chunk> chunks_;
+    size_t currentChunk_;
+    size_t offset_;
+
+    void* Allocate(size_t size);
+    void* Reallocate(void* p, size_t size);
+    void Free(void* p);
+
+    bool IsTop(void* p) const;
+
+    static void* SuiteMalloc(size_t size);
+    static void* SuiteRealloc(void* p, size_t size);
+    static void SuiteFree(void* p);
+  };
+
+} // james
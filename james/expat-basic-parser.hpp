@@ -0,0 +1,264 @@
+#pragma once
+
+#include <james/expat-parser.hpp>
+#include <assert.h>
+#include <type_traits>
+#include <utility>
+
+namespace james {
+
+  namespace detail {
+    template <typename...>
+    struct VoidT { typedef void type; };
+
+    // HasXxx<C>::value is true when C has a member Xxx callable with Expat's arguments
+    #define JAMES_DETECT_HANDLER(Name, Args) \
+      template <typename C, typename = void> \
+      struct Has##Name : std::false_type {}; \
+      template <typename C> \
+      struct Has##Name<C, typename VoidT<decltype(std::declval<C&>().Name Args)>::type> : std::true_type {};
+
+    JAMES_DETECT_HANDLER(StartElement, ((const char*) nullptr, (const char**) nullptr))
+    JAMES_DETECT_HANDLER(EndElement, ((const char*) nullptr))
+    JAMES_DETECT_HANDLER(CharacterData, ((const XML_Char*) nullptr, 0))
+    JAMES_DETECT_HANDLER(DefaultHandler, ((const XML_Char*) nullptr, 0))
+    JAMES_DETECT_HANDLER(ProcessingInstruction, ((const XML_Char*) nullptr, (const XML_Char*) nullptr))
+    JAMES_DETECT_HANDLER(Comment, ((const XML_Char*) nullptr))
+    JAMES_DETECT_HANDLER(StartCData, ())
+    JAMES_DETECT_HANDLER(EndCData, ())
+
+    #undef JAMES_DETECT_HANDLER
+
+    // False only for a C declaring "static const bool EXPAND_INTERNAL_ENTITIES = false"
+    template <typename C, typename = void>
+    struct ExpandsInternalEntities : std::true_type {};
+    template <typename C>
+    struct ExpandsInternalEntities<C, typename VoidT<decltype(C::EXPAND_INTERNAL_ENTITIES)>::type>
+      : std::integral_constant<bool, C::EXPAND_INTERNAL_ENTITIES> {};
+  }
+
+  //
+  // Statically dispatched alternative to ExpatParser.
+  //
+  // Consumer is any type with some subset of the ExpatParser::XMLConsumer member
+  // functions (they need not be virtual). Only the handlers Consumer actually has are
+  // registered with Expat, and they are called directly so the compiler can inline
+  // them into the callback Expat invokes - there is no RegisteredHandlers bitmask and
+  // no virtual call per event.
+  //
+  // A consumer derived from ExpatParser::XMLConsumer inherits all of its handlers, so
+  // has every one registered (as if by REGISTER_ALL_HANDLERS). Either way internal
+  // entities are still expanded & reach CharacterData: a DefaultHandler is installed
+  // with XML_SetDefaultHandlerExpand. A consumer which wants entity references passed
+  // to its DefaultHandler unexpanded instead (as XML_SetDefaultHandler does) declares
+  //
+  //   static const bool EXPAND_INTERNAL_ENTITIES = false;
+  //
+  // Exceptions thrown by the consumer are handled exactly as in ExpatParser: the parser
+  // is stopped and the exception rethrown from Parse()/ParseBuffer().
+  //
+  template <typename Consumer>
+  struct BasicExpatParser {
+
+    explicit BasicExpatParser(Consumer& consumer)
+      : consumer_(&consumer), parser_(XML_ParserCreate(nullptr)), done_(false)
+    {
+      if (!parser_) {
+        throw std::runtime_error("Unable to create Expat parser (XML_ParserCreate failed)");
+      }
+
+      InstallHandlers();
+    }
+
+    ~BasicExpatParser() {
+      XML_ParserFree(parser_);
+    }
+
+    BasicExpatParser(const BasicExpatParser&) = delete;
+    BasicExpatParser& operator =(const BasicExpatParser&) = delete;
+
+    void Parse(const char* data, size_t length, bool done) {
+      assert(!done_);
+
+      done_ = done;
+      currentException_ = nullptr;
+
+      if (XML_Parse(parser_, data, (int) length, done) == XML_STATUS_ERROR) {
+        ThrowParseError();
+      }
+    }
+
+    void Parse(const std::string& xml, bool done = true) {
+      Parse(xml.c_str(), xml.size(), done);
+    }
+
+    void* GetBuffer(size_t length) {
+      assert(!done_);
+
+      void* buffer = XML_GetBuffer(parser_, (int) length);
+
+      if (!buffer) {
+        throw ExpatParser::Exception(
+          XML_ErrorString(XML_GetErrorCode(parser_)),
+          XML_GetErrorCode(parser_),
+          XML_GetCurrentLineNumber(parser_)
+        );
+      }
+
+      return buffer;
+    }
+
+    void ParseBuffer(size_t length, bool done) {
+      assert(!done_);
+
+      done_ = done;
+      currentException_ = nullptr;
+
+      if (XML_ParseBuffer(parser_, (int) length, done) == XML_STATUS_ERROR) {
+        ThrowParseError();
+      }
+    }
+
+    void Reset() {
+      if (!XML_ParserReset(parser_, nullptr)) {
+        throw std::runtime_error("Unable to reset Expat parser (XML_ParserReset failed)");
+      }
+
+      InstallHandlers();
+
+      done_ = false;
+      currentException_ = nullptr;
+    }
+
+    void Reset(Consumer& consumer) {
+      consumer_ = &consumer;
+      Reset();
+    }
+
+  private:
+    Consumer* consumer_;
+    XML_Parser parser_;
+    bool done_;
+    std::exception_ptr currentException_;
+
+    void InstallHandlers() {
+      XML_SetUserData(parser_, this);
+
+      XML_SetElementHandler(
+        parser_,
+        StartElementFor<Consumer>(detail::HasStartElement<Consumer>()),
+        EndElementFor<Consumer>(detail::HasEndElement<Consumer>())
+      );
+      XML_SetCharacterDataHandler(parser_, CharacterDataFor<Consumer>(detail::HasCharacterData<Consumer>()));
+
+      // XML_SetDefaultHandler also turns off internal entity expansion (even when
+      // passed nullptr), so it's only used when the consumer asks for that
+      if (detail::ExpandsInternalEntities<Consumer>::value) {
+        XML_SetDefaultHandlerExpand(parser_, DefaultHandlerFor<Consumer>(detail::HasDefaultHandler<Consumer>()));
+      }
+      else {
+        XML_SetDefaultHandler(parser_, DefaultHandlerFor<Consumer>(detail::HasDefaultHandler<Consumer>()));
+      }
+
+      XML_SetProcessingInstructionHandler(parser_, ProcessingInstructionFor<Consumer>(detail::HasProcessingInstruction<Consumer>()));
+      XML_SetCommentHandler(parser_, CommentFor<Consumer>(detail::HasComment<Consumer>()));
+      XML_SetCdataSectionHandler(
+        parser_,
+        StartCDataFor<Consumer>(detail::HasStartCData<Consumer>()),
+        EndCDataFor<Consumer>(detail::HasEndCData<Consumer>())
+      );
+    }
+
+    void ThrowParseError() {
+      if (currentException_) {
+        std::rethrow_exception(currentException_);
+      }
+      else {
+        throw ExpatParser::Exception(
+          XML_ErrorString(XML_GetErrorCode(parser_)),
+          XML_GetErrorCode(parser_),
+          XML_GetCurrentLineNumber(parser_)
+        );
+      }
+    }
+
+    // Same exception guard as the ExpatParser callbacks (see ExpatParser::StartElement)
+    template <typename F>
+    static void Invoke(void* userData, F f) {
+      BasicExpatParser* parser = static_cast<BasicExpatParser*>(userData);
+
+      if (parser->currentException_) {
+        return;
+      }
+
+      try {
+        f(*parser->consumer_);
+      }
+      catch (...) {
+        XML_StopParser(parser->parser_, XML_FALSE);
+        parser->currentException_ = std::current_exception();
+      }
+    }
+
+    // Each XxxFor<C>() returns the Expat callback for handler Xxx, or nullptr when
+    // the consumer has no such handler. The callbacks are templates so that they are
+    // only instantiated for handlers which exist.
+
+    template <typename C>
+    static void XMLCALL StartElementCallback(void *userData, const char *name, const char **atts) {
+      Invoke(userData, [=](C& c) { c.StartElement(name, atts); });
+    }
+    template <typename C> static XML_StartElementHandler StartElementFor(std::true_type) { return StartElementCallback<C>; }
+    template <typename C> static XML_StartElementHandler StartElementFor(std::false_type) { return nullptr; }
+
+    template <typename C>
+    static void XMLCALL EndElementCallback(void *userData, const char *name) {
+      Invoke(userData, [=](C& c) { c.EndElement(name); });
+    }
+    template <typename C> static XML_EndElementHandler EndElementFor(std::true_type) { return EndElementCallback<C>; }
+    template <typename C> static XML_EndElementHandler EndElementFor(std::false_type) { return nullptr; }
+
+    template <typename C>
+    static void XMLCALL CharacterDataCallback(void *userData, const XML_Char *s, int len) {
+      Invoke(userData, [=](C& c) { c.CharacterData(s, len); });
+    }
+    template <typename C> static XML_CharacterDataHandler CharacterDataFor(std::true_type) { return CharacterDataCallback<C>; }
+    template <typename C> static XML_CharacterDataHandler CharacterDataFor(std::false_type) { return nullptr; }
+
+    template <typename C>
+    static void XMLCALL DefaultHandlerCallback(void *userData, const XML_Char *s, int len) {
+      Invoke(userData, [=](C& c) { c.DefaultHandler(s, len); });
+    }
+    template <typename C> static XML_DefaultHandler DefaultHandlerFor(std::true_type) { return DefaultHandlerCallback<C>; }
+    template <typename C> static XML_DefaultHandler DefaultHandlerFor(std::false_type) { return nullptr; }
+
+    template <typename C>
+    static void XMLCALL ProcessingInstructionCallback(void *userData, const XML_Char *target, const XML_Char *data) {
+      Invoke(userData, [=](C& c) { c.ProcessingInstruction(target, data); });
+    }
+    template <typename C> static XML_ProcessingInstructionHandler ProcessingInstructionFor(std::true_type) { return ProcessingInstructionCallback<C>; }
+    template <typename C> static XML_ProcessingInstructionHandler ProcessingInstructionFor(std::false_type) { return nullptr; }
+
+    template <typename C>
+    static void XMLCALL CommentCallback(void *userData, const XML_Char *data) {
+      Invoke(userData, [=](C& c) { c.Comment(data); });
+    }
+    template <typename C> static XML_CommentHandler CommentFor(std::true_type) { return CommentCallback<C>; }
+    template <typename C> static XML_CommentHandler CommentFor(std::false_type) { return nullptr; }
+
+    template <typename C>
+    static void XMLCALL StartCDataCallback(void *userData) {
+      Invoke(userData, [](C& c) { c.StartCData(); });
+    }
+    template <typename C> static XML_StartCdataSectionHandler StartCDataFor(std::true_type) { return StartCDataCallback<C>; }
+    template <typename C> static XML_StartCdataSectionHandler StartCDataFor(std::false_type) { return nullptr; }
+
+    template <typename C>
+    static void XMLCALL EndCDataCallback(void *userData) {
+      Invoke(userData, [](C& c) { c.EndCData(); });
+    }
+    template <typename C> static XML_EndCdataSectionHandler EndCDataFor(std::true_type) { return EndCDataCallback<C>; }
+    template <typename C> static XML_EndCdataSectionHandler EndCDataFor(std::false_type) { return nullptr; }
+  };
+
+} // james
@@ -0,0 +1,125 @@
+#include "expat-batch-parser.hpp"
+
+#include <algorithm>
+
+namespace james {
+
+  ExpatBatchParser::ExpatBatchParser(BatchConsumer& consumer, size_t batchSize, size_t textLimit)
+    : consumer_(&consumer), batchSize_(std::max(batchSize, (size_t) 1)), textLimit_(textLimit),
+      batch_(names_), collector_{this}, parser_(collector_)
+  {
+    // A DefaultHandler would stop Expat expanding internal entities, and their text
+    // would then never reach CharacterData (see BasicExpatParser::InstallHandlers)
+    static_assert(!detail::HasDefaultHandler<Collector>::value, "ExpatBatchParser relies on internal entities being expanded");
+
+    batch_.events.reserve(batchSize_);
+  }
+
+  void ExpatBatchParser::Parse(const char* data, size_t length, bool done) {
+    parser_.Parse(data, length, done);
+
+    if (done) {
+      Flush();
+    }
+  }
+
+  void ExpatBatchParser::Parse(const std::string& xml, bool done) {
+    Parse(xml.c_str(), xml.size(), done);
+  }
+
+  void ExpatBatchParser::ParseBuffer(size_t length, bool done) {
+    parser_.ParseBuffer(length, done);
+
+    if (done) {
+      Flush();
+    }
+  }
+
+  void ExpatBatchParser::Reset() {
+    parser_.Reset();
+    batch_.Clear();
+  }
+
+  void ExpatBatchParser::Flush() {
+    if (batch_.events.empty()) {
+      return;
+    }
+
+    // Cleared even if the consumer throws, so a failed batch isn't delivered twice
+    struct ClearOnExit {
+      EventBatch& batch;
+      ~ClearOnExit() { batch.Clear(); }
+    } clear = { batch_ };
+
+    consumer_->Events(batch_);
+  }
+
+  std::uint32_t ExpatBatchParser::AddText(const char* s, size_t len) {
+    const std::uint32_t offset = (std::uint32_t) batch_.text.size();
+    batch_.text.append(s, len);
+    return offset;
+  }
+
+  void ExpatBatchParser::Added() {
+    if (batch_.events.size() >= batchSize_ || batch_.text.size() >= textLimit_) {
+      Flush();
+    }
+  }
+
+  void ExpatBatchParser::Collector::StartElement(const char *name, const char **atts) {
+    EventBatch& batch = owner->batch_;
+
+    EventBatch::Event e;
+    e.type = EventBatch::START_ELEMENT;
+    e.name = (std::uint32_t) owner->names_.Intern(name);
+    e.offset = (std::uint32_t) batch.attributes.size();
+    e.length = 0;
+
+    for (; atts[0]; atts += 2) {
+      EventBatch::Attribute a;
+      a.name = (std::uint32_t) owner->names_.Intern(atts[0]);
+      a.length = (std::uint32_t) strlen(atts[1]);
+      a.offset = owner->AddText(atts[1], a.length);
+
+      batch.attributes.push_back(a);
+      e.length++;
+    }
+
+    batch.events.push_back(e);
+    owner->Added();
+  }
+
+  void ExpatBatchParser::Collector::EndElement(const char *name) {
+    EventBatch::Event e;
+    e.type = EventBatch::END_ELEMENT;
+    e.name = (std::uint32_t) owner->names_.Intern(name);
+    e.offset = 0;
+    e.length = 0;
+
+    owner->batch_.events.push_back(e);
+    owner->Added();
+  }
+
+  void ExpatBatchParser::Collector::CharacterData(const XML_Char *s, int len) {
+    EventBatch& batch = owner->batch_;
+
+    // Expat splits text at newlines & entities; the pieces of one run are always
+    // appended to the text buffer last, so they can simply be joined up
+    if (!batch.events.empty() && batch.events.back().type == EventBatch::TEXT) {
+      owner->AddText(s, (size_t) len);
+      batch.events.back().length += (std::uint32_t) len;
+    }
+    else {
+      EventBatch::Event e;
+      e.type = EventBatch::TEXT;
+      e.name = 0;
+      e.length = (std::uint32_t) len;
+      e.offset = owner->AddText(s, (size_t) len);
+
+      batch.events.push_back(e);
+    }
+
+    owner->Added();
+  }
+
+} // james
@@ -0,0 +1,130 @@
+#pragma once
+
+#include <james/expat-basic-parser.hpp>
+#include <james/expat-name-table.hpp>
+#include <james/expat-string-view.hpp>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace james {
+
+  //
+  // A block of parse events laid out contiguously, for consumers that would rather
+  // loop over an array than take a virtual call per event.
+  //
+  // Element & attribute names are ids in the parser's NameTable (they stay the same
+  // from one batch & document to the next, so consumers can compare ids instead of
+  // strings); text & attribute values are offsets into the batch's text buffer.
+  //
+  struct EventBatch {
+    enum EventType : std::uint8_t {
+      START_ELEMENT,
+      END_ELEMENT,
+      TEXT
+    };
+
+    struct Event {
+      EventType type;
+      std::uint32_t name;    // START_ELEMENT & END_ELEMENT: NameTable id
+      std::uint32_t offset;  // TEXT: into text; START_ELEMENT: first entry in attributes
+      std::uint32_t length;  // TEXT: bytes; START_ELEMENT: number of attributes
+    };
+
+    struct Attribute {
+      std::uint32_t name;    // NameTable id
+      std::uint32_t offset;  // Value, in text
+      std::uint32_t length;
+    };
+
+    std::vector<Event> events;
+    std::vector<Attribute> attributes;
+    std::string text;
+
+    explicit EventBatch(const NameTable& names) : names_(&names) {}
+
+    const Event* begin() const { return events.data(); }
+    const Event* end() const { return events.data() + events.size(); }
+    size_t Size() const { return events.size(); }
+
+    const std::string& Name(const Event& e) const { return names_->Name(e.name); }
+    const std::string& Name(const Attribute& a) const { return names_->Name(a.name); }
+
+    StringView Text(const Event& e) const { return StringView(text.data() + e.offset, e.length); }
+    StringView Value(const Attribute& a) const { return StringView(text.data() + a.offset, a.length); }
+
+    const Attribute* AttributesBegin(const Event& e) const { return attributes.data() + e.offset; }
+    const Attribute* AttributesEnd(const Event& e) const { return attributes.data() + e.offset + e.length; }
+
+    void Clear() {
+      events.clear();
+      attributes.clear();
+      text.clear();
+    }
+
+  private:
+    const NameTable* names_;
+  };
+
+  //
+  // Parser which delivers events to a BatchConsumer in batches rather than one call
+  // at a time.
+  //
+  // Events are collected (through BasicExpatParser, so without virtual calls) until
+  // batchSize events or textLimit bytes of text have built up, and when the document
+  // ends. Consecutive character data is merged into a single TEXT event, except where
+  // a batch boundary falls in the middle of a run of text.
+  //
+  // A batch, and everything in it, is only valid for the duration of the call to
+  // Events(). Exceptions thrown by Events() propagate from Parse()/ParseBuffer().
+  //
+  struct ExpatBatchParser {
+    struct BatchConsumer {
+      virtual ~BatchConsumer() {}
+      virtual void Events(const EventBatch&) = 0;
+    };
+
+    explicit ExpatBatchParser(BatchConsumer&, size_t batchSize = 1024, size_t textLimit = 256 * 1024);
+
+    ExpatBatchParser(const ExpatBatchParser&) = delete;
+    ExpatBatchParser& operator =(const ExpatBatchParser&) = delete;
+
+    void Parse(const char* data, size_t length, bool done);
+    void Parse(const std::string&, bool done = true);
+
+    // As ExpatParser::GetBuffer/ParseBuffer
+    void* GetBuffer(size_t length) { return parser_.GetBuffer(length); }
+    void ParseBuffer(size_t length, bool done);
+
+    // Drops any undelivered events. The NameTable (and so the name ids) is kept.
+    void Reset();
+
+    // Hands any events collected so far to the consumer without waiting for the batch
+    // to fill up (nothing is called when there are none)
+    void Flush();
+
+    const NameTable& Names() const { return names_; }
+
+  private:
+    // Receives the events from BasicExpatParser
+    struct Collector {
+      ExpatBatchParser* owner;
+
+      void StartElement(const char *name, const char **atts);
+      void EndElement(const char *name);
+      void CharacterData(const XML_Char *s, int len);
+    };
+
+    BatchConsumer* consumer_;
+    size_t batchSize_;
+    size_t textLimit_;
+    NameTable names_;
+    EventBatch batch_;
+    Collector collector_;
+    BasicExpatParser<Collector> parser_;
+
+    std::uint32_t AddText(const char* s, size_t len);
+    void Added();
+  };
+
+} // james
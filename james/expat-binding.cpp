@@ -0,0 +1,47 @@
+#include "expat-binding.hpp"
+#include "expat-util.hpp"
+
+#include <algorithm>
+#include <cstring>
+
+namespace james {
+
+  namespace detail {
+    void NumberText::Append(const char* s, std::size_t len) {
+      if (length == 0) {
+        while (len > 0 && IsSpace(*s)) {
+          ++s;
+          --len;
+        }
+      }
+
+      // Leaving room for the terminator
+      const std::size_t fits = std::min(len, sizeof(buffer) - 1 - length);
+
+      memcpy(buffer + length, s, fits);
+      length += fits;
+
+      for (std::size_t i = fits; i < len; ++i) {
+        overflow = overflow || !IsSpace(s[i]);
+      }
+    }
+
+    const char* NumberText::Value() {
+      if (overflow) {
+        return nullptr;
+      }
+
+      while (length > 0 && IsSpace(buffer[length - 1])) {
+        --length;
+      }
+
+      buffer[length] = '\0';
+      return buffer;
+    }
+
+    std::string NumberText::Str() const {
+      return std::string(buffer, length) + (overflow ? "..." : "");
+    }
+  }
+
+} // james
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <james/expat-facade.hpp>
+#include <climits>
+#include <cstring>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+namespace james {
+
+  namespace detail {
+    // The member types a Binding can fill; BindingTypeOf<M> is only defined for these
+    enum BindingType { BIND_STRING, BIND_INT, BIND_LONG_LONG, BIND_DOUBLE, BIND_BOOL };
+
+    template <typename M> struct BindingTypeOf;
+    template <> struct BindingTypeOf<std::string> { static const BindingType value = BIND_STRING; };
+    template <> struct BindingTypeOf<int> { static const BindingType value = BIND_INT; };
+    template <> struct BindingTypeOf<long long> { static const BindingType value = BIND_LONG_LONG; };
+    template <> struct BindingTypeOf<double> { static const BindingType value = BIND_DOUBLE; };
+    template <> struct BindingTypeOf<bool> { static const BindingType value = BIND_BOOL; };
+
+    // Gathers the text of an element bound to a number or boolean, which arrives from
+    // Expat in one or more chunks. Leading whitespace is dropped & anything past the
+    // buffer's end must be whitespace, since no valid value is that long.
+    struct NumberText {
+      NumberText() : length(0), overflow(false) {}
+
+      void Clear() { length = 0; overflow = false; }
+      void Append(const char* s, std::size_t len);
+
+      // The text less trailing whitespace & null terminated; nullptr if it didn't fit
+      const char* Value();
+
+      // For error messages
+      std::string Str() const;
+
+    private:
+      char buffer[64];
+      std::size_t length;
+      bool overflow;
+    };
+  }
+
+  //
+  // Fills in a T for each element at path & hands it to a callback, e.g.
+  //
+  //   struct Trade { long long id; std::string symbol; double price; };
+  //
+  //   Bind<Trade>("/feed/trade")
+  //     .Attr("id", &Trade::id)
+  //     .Text("symbol", &Trade::symbol)
+  //     .Text("price", &Trade::price)
+  //     .Attach(facade, [](const Trade& t) { ... });
+  //
+  // The Binding is a table of the bound members (tagged with their type, so setting
+  // one is a switch rather than a virtual call) & a tree of the bound child paths,
+  // built once. Attach() gives the facade a consumer for the record element's subtree
+  // (see Tag::Subtree) which follows the open child elements through that tree by
+  // depth and fills the record straight from Expat's events: strings are appended to
+  // their members chunk by chunk & numbers gathered in a small fixed buffer, so no
+  // std::function is called & no std::string is built along the way. Members may be
+  // std::string, int, long long, double or bool; binding any other type doesn't
+  // compile.
+  //
+  // Attribute values are converted as by Attributes::GetInt & co, so must not have
+  // surrounding whitespace. Element text may have whitespace around numbers &
+  // booleans; the text of an element split by its children (e.g. "head" & "tail" in
+  // <r>head<d/>tail</r>) is joined up.
+  //
+  // Each record starts out as a value initialised T. Missing attributes, and missing
+  // or empty elements, leave their members alone; a value which can't be converted throws
+  // std::runtime_error, which ends the parse.
+  //
+  template <typename T>
+  struct Binding {
+    explicit Binding(const std::string& path) : path_(path), nodes_(1) {}
+
+    template <typename M>
+    Binding& Attr(const char* name, M T::*member) {
+      attributes_.push_back(Field(name, member));
+      return *this;
+    }
+
+    // child is a path relative to the record element ("" for the element's own text)
+    template <typename M>
+    Binding& Text(const std::string& child, M T::*member) {
+      std::size_t node = 0;
+      std::size_t begin = 0;
+
+      while (begin < child.size()) {
+        std::size_t end = child.find('/', begin);
+        if (end == std::string::npos) {
+          end = child.size();
+        }
+        if (end > begin) {
+          node = ChildNode(node, child.substr(begin, end - begin));
+        }
+        begin = end + 1;
+      }
+
+      const Field field(child, member);
+      nodes_[node].numeric = nodes_[node].numeric || field.type != detail::BIND_STRING;
+      nodes_[node].fields.push_back(text_.size());
+      text_.push_back(field);
+      return *this;
+    }
+
+    // Registers a consumer for the record element with facade, which keeps it (and a
+    // copy of the binding) alive. The binding may be attached to any number of facades
+    // & needn't outlive them. onRecord is called as f(const T&).
+    template <typename F>
+    void Attach(ExpatFacade& facade, F onRecord) const {
+      facade.ListenFor(path_, Tag().Subtree(std::make_shared<Binder<F>>(*this, facade, onRecord)));
+    }
+
+  private:
+    struct Field {
+      std::string name;
+      detail::BindingType type;
+
+      union {
+        std::string T::*s;
+        int T::*i;
+        long long T::*ll;
+        double T::*d;
+        bool T::*b;
+      } member;
+
+      template <typename M>
+      Field(const std::string& name, M T::*m) : name(name), type(detail::BindingTypeOf<M>::value) { Store(m); }
+
+      void Store(std::string T::*m) { member.s = m; }
+      void Store(int T::*m) { member.i = m; }
+      void Store(long long T::*m) { member.ll = m; }
+      void Store(double T::*m) { member.d = m; }
+      void Store(bool T::*m) { member.b = m; }
+
+      // s must be null terminated & without surrounding whitespace (bar strings)
+      bool Set(T& record, const char* s) const {
+        switch (type) {
+        case detail::BIND_STRING:
+          (record.*member.s).assign(s);
+          return true;
+
+        case detail::BIND_INT: {
+          long long v;
+          if (!detail::ParseInteger(s, INT_MIN, INT_MAX, v)) {
+            return false;
+          }
+          record.*member.i = (int) v;
+          return true;
+        }
+
+        case detail::BIND_LONG_LONG:
+          return detail::ParseInteger(s, LLONG_MIN, LLONG_MAX, record.*member.ll);
+
+        case detail::BIND_DOUBLE:
+          return detail::ParseDouble(s, record.*member.d);
+
+        case detail::BIND_BOOL:
+          return detail::ParseBool(s, record.*member.b);
+        }
+        return false;
+      }
+    };
+
+    // A bound child path, relative to the record element (node 0)
+    struct Node {
+      std::string name;
+      std::vector<std::size_t> children;  // Indexes into nodes_
+      std::vector<std::size_t> fields;    // Indexes into text_
+      bool numeric;                       // Any of fields is a number or boolean
+
+      Node() : numeric(false) {}
+    };
+
+    std::string path_;
+    std::vector<Field> attributes_;
+    std::vector<Field> text_;
+    std::vector<Node> nodes_;
+
+    std::size_t ChildNode(std::size_t parent, const std::string& name) {
+      for (std::size_t c : nodes_[parent].children) {
+        if (nodes_[c].name == name) {
+          return c;
+        }
+      }
+
+      Node n;
+      n.name = name;
+      nodes_.push_back(n);
+      nodes_[parent].children.push_back(nodes_.size() - 1);
+      return nodes_.size() - 1;
+    }
+
+    static void Invalid(const Field& f, const std::string& value) {
+      throw std::runtime_error("Invalid value \"" + value + "\" for " + f.name);
+    }
+
+    // Receives the record element's events, & those of everything inside it, from the
+    // facade
+    template <typename F>
+    struct Binder
+      : ExpatParser::XMLConsumer
+    {
+      Binder(const Binding& binding, const ExpatFacade& facade, F onRecord)
+        : binding_(binding), facade_(facade), onRecord_(onRecord), recordDepth_(ExpatFacade::PathDepth(binding.path_))
+      {
+      }
+
+    private:
+      static const std::size_t NO_NODE = (std::size_t) -1;
+
+      // An open element of the current record
+      struct Open {
+        std::size_t node;  // Into binding_.nodes_, NO_NODE if nothing is bound at or below it
+        bool hasText;
+        detail::NumberText number;
+
+        Open() : node(NO_NODE), hasText(false) {}
+      };
+
+      const Binding binding_;
+      const ExpatFacade& facade_;
+      F onRecord_;
+      int recordDepth_;
+
+      T record_;
+      std::vector<Open> open_;
+
+      std::size_t Find(std::size_t parent, const char* name) const {
+        if (parent != NO_NODE) {
+          for (std::size_t c : binding_.nodes_[parent].children) {
+            if (strcmp(binding_.nodes_[c].name.c_str(), name) == 0) {
+              return c;
+            }
+          }
+        }
+        return NO_NODE;
+      }
+
+      void StartElement(const char *name, const char **atts) override {
+        // The facade's depth (rather than open_) says where a record starts, so one cut
+        // short by a failed parse is simply dropped
+        const std::size_t level = (std::size_t) (facade_.CurrentPath().depth - recordDepth_);
+        std::size_t node = 0;
+
+        if (level == 0) {
+          open_.clear();
+          record_ = T();
+
+          for (; atts[0]; atts += 2) {
+            for (const Field& f : binding_.attributes_) {
+              if (strcmp(f.name.c_str(), atts[0]) == 0 && !f.Set(record_, atts[1])) {
+                Invalid(f, atts[1]);
+              }
+            }
+          }
+        }
+        else {
+          node = open_.size() >= level ? Find(open_[level - 1].node, name) : NO_NODE;
+          open_.resize(level);
+        }
+
+        open_.push_back(Open());
+        open_.back().node = node;
+      }
+
+      void CharacterData(const XML_Char *s, int len) override {
+        if (open_.empty() || open_.back().node == NO_NODE || len == 0) {
+          return;
+        }
+
+        Open& open = open_.back();
+        const Node& node = binding_.nodes_[open.node];
+
+        for (std::size_t i : node.fields) {
+          const Field& f = binding_.text_[i];
+
+          if (f.type == detail::BIND_STRING) {
+            if (!open.hasText) {
+              (record_.*f.member.s).clear();
+            }
+            (record_.*f.member.s).append(s, (std::size_t) len);
+          }
+        }
+
+        if (node.numeric) {
+          open.number.Append(s, (std::size_t) len);
+        }
+
+        open.hasText = true;
+      }
+
+      void EndElement(const char *name) override {
+        if (open_.empty()) {
+          return;
+        }
+
+        Open& open = open_.back();
+
+        if (open.node != NO_NODE && open.hasText && binding_.nodes_[open.node].numeric) {
+          const char* value = open.number.Value();
+
+          for (std::size_t i : binding_.nodes_[open.node].fields) {
+            const Field& f = binding_.text_[i];
+
+            if (f.type != detail::BIND_STRING && (!value || !f.Set(record_, value))) {
+              Invalid(f, open.number.Str());
+            }
+          }
+        }
+
+        open_.pop_back();
+
+        if (open_.empty()) {
+          onRecord_(static_cast<const T&>(record_));
+        }
+      }
+    };
+  };
+
+  template <typename T>
+  Binding<T> Bind(const std::string& path) {
+    return Binding<T>(path);
+  }
+
+} // james
@@ -1,12 +1,93 @@
 #include "expat-facade.hpp"
+#include "expat-hash.hpp"
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <clocale>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+#include <limits>
+#include <assert.h>
 
 using namespace std;
 
 namespace james {
 
-  Attributes::Attributes(const char** data)
-    : data_(data)
+  const std::size_t AttributeIndex::SIZE;
+  const std::size_t Attributes::INDEX_THRESHOLD;
+
+  void AttributeIndex::NewDocument() {
+    // The last document's name pointers may be reused for different names
+    cacheNames = nullptr;
+  }
+
+  int AttributeIndex::KeyId(const NameTable& names, const char* name) {
+    if (cacheNames != &names || cacheNamesSize != names.Size()) {
+      CachedName empty = { nullptr, NameTable::NOT_FOUND };
+      cache.assign(std::max(cache.size(), (std::size_t) 32), empty);
+      cacheNames = &names;
+      cacheNamesSize = names.Size();
+      cacheCount = 0;
+    }
+
+    std::size_t mask = cache.size() - 1;
+    std::size_t i = (std::size_t) (reinterpret_cast<std::uintptr_t>(name) >> 3) & mask;
+
+    for (; cache[i].name; i = (i + 1) & mask) {
+      if (cache[i].name == name) {
+        return cache[i].id;
+      }
+    }
+
+    // First time this pointer has come up in the document
+    const int id = names.Find(name);
+
+    if ((cacheCount + 1) * 2 > cache.size()) {
+      std::vector<CachedName> old;
+      old.swap(cache);
+
+      CachedName empty = { nullptr, NameTable::NOT_FOUND };
+      cache.assign(old.size() * 2, empty);
+      mask = cache.size() - 1;
+
+      for (auto& c : old) {
+        if (c.name) {
+          std::size_t j = (std::size_t) (reinterpret_cast<std::uintptr_t>(c.name) >> 3) & mask;
+          while (cache[j].name) {
+            j = (j + 1) & mask;
+          }
+          cache[j] = c;
+        }
+      }
+
+      i = (std::size_t) (reinterpret_cast<std::uintptr_t>(name) >> 3) & mask;
+      while (cache[i].name) {
+        i = (i + 1) & mask;
+      }
+    }
+
+    cache[i].name = name;
+    cache[i].id = id;
+    cacheCount++;
+
+    return id;
+  }
+
+  Attributes::Attributes(const char** data, AttributeIndex* index)
+    : data_(data), length_(0), index_(index)
   {
+    while (data_[2 * length_]) {
+      length_++;
+    }
+
+    // Expat passes every element's attributes in the same array, so the index can't
+    // tell one element from the next by data_ alone
+    if (index_) {
+      index_->data = nullptr;
+      index_->keyNames = nullptr;
+    }
   }
 
   Attributes::Iterator begin(const Attributes& a) {
@@ -14,48 +95,488 @@ namespace james {
   }
 
   Attributes::Iterator end(const Attributes& a) {
-    const char** i = a.data_;
-    while (*(i += 2)) {}
-    return Attributes::Iterator(i);
+    return Attributes::Iterator(a.data_ + 2 * a.length_);
+  }
+
+  void Attributes::BuildIndex() const {
+    const std::size_t mask = AttributeIndex::SIZE - 1;
+
+    memset(index_->slots, 0, sizeof(index_->slots));
+
+    for (std::size_t a = 0; a < length_; ++a) {
+      std::size_t i = HashString(data_[2 * a]) & mask;
+      while (index_->slots[i]) {
+        i = (i + 1) & mask;
+      }
+      index_->slots[i] = (unsigned char) (a + 1);
+    }
+
+    index_->data = data_;
+  }
+
+  int Attributes::Find(const char* name) const {
+    if (length_ <= INDEX_THRESHOLD || !Indexable()) {
+      for (std::size_t a = 0; a < length_; ++a) {
+        if (strcmp(data_[2 * a], name) == 0) {
+          return (int) a;
+        }
+      }
+      return -1;
+    }
+
+    if (index_->data != data_) {
+      BuildIndex();
+    }
+
+    const std::size_t mask = AttributeIndex::SIZE - 1;
+
+    for (std::size_t i = HashString(name) & mask; index_->slots[i]; i = (i + 1) & mask) {
+      const int a = index_->slots[i] - 1;
+      if (strcmp(data_[2 * a], name) == 0) {
+        return a;
+      }
+    }
+
+    return -1;
+  }
+
+  int Attributes::Find(const AttrKey& key) const {
+    if (!key.names || key.id == NameTable::NOT_FOUND) {
+      return -1;
+    }
+
+    if (!Indexable()) {
+      return Find(key.names->Name(key.id).c_str());
+    }
+
+    if (index_->keyNames != key.names || index_->keyNamesSize != key.names->Size()) {
+      for (std::size_t a = 0; a < length_; ++a) {
+        index_->keys[a] = index_->KeyId(*key.names, data_[2 * a]);
+      }
+      index_->keyNames = key.names;
+      index_->keyNamesSize = key.names->Size();
+    }
+
+    for (std::size_t a = 0; a < length_; ++a) {
+      if (index_->keys[a] == key.id) {
+        return (int) a;
+      }
+    }
+
+    return -1;
+  }
+
+  namespace {
+    bool ParseDoubleSpecial(const char* s, double& value) {
+      if (strcmp(s, "NaN") == 0) {
+        value = std::numeric_limits<double>::quiet_NaN();
+      }
+      else {
+        value = *s == '-' ? -std::numeric_limits<double>::infinity() : std::numeric_limits<double>::infinity();
+      }
+      return true;
+    }
+  }
+
+  namespace detail {
+    bool ParseInteger(const char* s, long long min, long long max, long long& value) {
+      const bool negative = *s == '-';
+      if (*s == '-' || *s == '+') {
+        ++s;
+      }
+
+      if (!*s) {
+        return false;
+      }
+
+      // Accumulated as unsigned so that LLONG_MIN's magnitude fits
+      const unsigned long long limit = negative
+        ? (min < 0 ? 0ull - (unsigned long long) min : 0ull)
+        : (unsigned long long) max;
+      unsigned long long magnitude = 0;
+
+      for (; *s; ++s) {
+        const unsigned digit = (unsigned) (*s - '0');
+
+        if (digit > 9 || magnitude > limit / 10 || magnitude * 10 + digit > limit) {
+          return false;
+        }
+
+        magnitude = magnitude * 10 + digit;
+      }
+
+      value = negative ? (long long) (0ull - magnitude) : (long long) magnitude;
+      return true;
+    }
+
+    bool ParseDouble(const char* s, double& value) {
+      // Checked against the xs:double grammar first since strtod would also take
+      // leading space, hex, "infinity", "nan(...)" & so on
+      if (strcmp(s, "INF") == 0 || strcmp(s, "+INF") == 0 || strcmp(s, "-INF") == 0 || strcmp(s, "NaN") == 0) {
+        return ParseDoubleSpecial(s, value);
+      }
+
+      const char* p = s;
+      if (*p == '-' || *p == '+') {
+        ++p;
+      }
+
+      const char* digits = p;
+      while (isdigit((unsigned char) *p)) {
+        ++p;
+      }
+      std::size_t mantissaDigits = (std::size_t) (p - digits);
+
+      if (*p == '.') {
+        digits = ++p;
+        while (isdigit((unsigned char) *p)) {
+          ++p;
+        }
+        mantissaDigits += (std::size_t) (p - digits);
+      }
+
+      if (mantissaDigits == 0) {
+        return false;
+      }
+
+      if (*p == 'e' || *p == 'E') {
+        ++p;
+        if (*p == '-' || *p == '+') {
+          ++p;
+        }
+        if (!isdigit((unsigned char) *p)) {
+          return false;
+        }
+        while (isdigit((unsigned char) *p)) {
+          ++p;
+        }
+      }
+
+      if (*p) {
+        return false;
+      }
+
+      // strtod follows the global C locale's decimal point, so a '.' is swapped for
+      // that where it differs (rarely, so the copy is no great cost)
+      const char* point = localeconv()->decimal_point;
+      std::string localised;
+
+      if (strcmp(point, ".") != 0 && strchr(s, '.')) {
+        localised = s;
+        localised.replace(localised.find('.'), 1, point);
+        s = localised.c_str();
+      }
+
+      char* end;
+      errno = 0;
+      const double v = strtod(s, &end);
+
+      // Values too small for a double round towards 0 (as xs:double says they should)
+      // but those too large are out of range
+      if (*end || (errno == ERANGE && (v == HUGE_VAL || v == -HUGE_VAL))) {
+        return false;
+      }
+
+      value = v;
+      return true;
+    }
+
+    bool ParseBool(const char* s, bool& value) {
+      if (strcmp(s, "true") == 0 || strcmp(s, "1") == 0) {
+        value = true;
+        return true;
+      }
+
+      if (strcmp(s, "false") == 0 || strcmp(s, "0") == 0) {
+        value = false;
+        return true;
+      }
+
+      return false;
+    }
+  }
+
+  namespace {
+    // Hash of the empty path (i.e. the document, outside the root element)
+    const std::size_t ROOT_HASH = FNV_OFFSET_BASIS;
   }
 
   ExpatFacade::ExpatFacade()
+    : stopWhenAllFired_(false)
   {
+    Frame document = { ROOT_HASH, nullptr, 0 };
+    stack_.push_back(document);
+
+    RebuildIndex();
+  }
+
+  void ExpatFacade::Reset() {
+    for (auto& p : paths_) {
+      for (auto& t : p.tags) {
+        t.instanceCount = 0;
+        t.finished = false;
+      }
+      EndText(p);
+    }
+
+    stack_.resize(1);
+    pathBuffer_.clear();
+    currentPath_ = Path();
+    subtrees_.clear();
+    attributeIndex_.NewDocument();
+  }
+
+  std::size_t ExpatFacade::HashPath(std::size_t parentHash, const char* name) {
+    // The hash of the path string; since FNV-1a works left to right the hash of
+    // "/a/b" is just the hash of "/a" continued over "/b".
+    return HashString(name, HashChar(parentHash, '/'));
+  }
+
+  ExpatFacade::PathListeners* ExpatFacade::FindListeners(std::size_t hash, StringView path) {
+    const std::size_t mask = index_.size() - 1;
+
+    for (std::size_t i = hash & mask; index_[i] >= 0; i = (i + 1) & mask) {
+      PathListeners& p = paths_[index_[i]];
+
+      // Only compare the full path when the hashes agree
+      if (p.hash == hash && StringView(p.path) == path) {
+        return &p;
+      }
+    }
+
+    return nullptr;
+  }
+
+  void ExpatFacade::RebuildIndex() {
+    // Keep the load factor under 1/2 so probe sequences stay short
+    std::size_t size = 16;
+    while (size < paths_.size() * 2) {
+      size *= 2;
+    }
+
+    index_.assign(size, -1);
+
+    const std::size_t mask = size - 1;
+
+    for (std::size_t p = 0; p < paths_.size(); ++p) {
+      std::size_t i = paths_[p].hash & mask;
+      while (index_[i] >= 0) {
+        i = (i + 1) & mask;
+      }
+      index_[i] = (int) p;
+    }
+  }
+
+  ExpatFacade::PathListeners* ExpatFacade::AddPath(std::size_t hash, const std::string& path) {
+    PathListeners* listeners = FindListeners(hash, path);
+
+    if (!listeners) {
+      PathListeners p;
+      p.path = path;
+      p.hash = hash;
+      paths_.push_back(p);
+      RebuildIndex();
+
+      listeners = &paths_.back();
+    }
+
+    return listeners;
   }
 
   void ExpatFacade::ListenFor(const std::string& path, const Tag& t) {
-    tags_.insert(make_pair(path, TagData(t)));
+    assert(stack_.size() == 1 && "ExpatFacade::ListenFor called while parsing (call Reset() after a failed parse)");
+
+    // Normalise the path to the form currentPath_.path takes (i.e. "/a/b") and hash
+    // it the same way StartElement does.
+    //
+    // Every ancestor of the path gets an entry too (with no tags) so that an element
+    // with no entry has no listeners anywhere beneath it & can be skipped.
+    std::string normalised;
+    std::size_t hash = ROOT_HASH;
+    std::string::size_type begin = 0;
+    PathListeners* listeners = AddPath(hash, normalised);
+
+    while (begin < path.size()) {
+      std::string::size_type end = path.find('/', begin);
+      if (end == std::string::npos) {
+        end = path.size();
+      }
+
+      if (end > begin) {
+        const std::string name(path, begin, end - begin);
+        normalised += "/" + name;
+        hash = HashPath(hash, name.c_str());
+        listeners = AddPath(hash, normalised);
+      }
+
+      begin = end + 1;
+    }
+
+    listeners->tags.push_back(TagData(t));
+    listeners->wantsText = listeners->wantsText || t.WantsText();
+    listeners->streamsText = listeners->streamsText || t.TextChunk;
+  }
+
+  int ExpatFacade::PathDepth(const std::string& path) {
+    int depth = 0;
+
+    for (std::string::size_type i = 0; i < path.size(); ++i) {
+      if (path[i] != '/' && (i == 0 || path[i - 1] == '/')) {
+        ++depth;
+      }
+    }
+
+    return depth;
+  }
+
+  void ExpatFacade::DispatchText(TagData& t, const Path& path, const PathListeners& listeners) {
+    // Ends the current run of text for one listener: either closing off its stream
+    // or delivering the accumulated text
+    if (t.streaming) {
+      t.tag.TextChunk(path, StringView(), false, true);
+      return;
+    }
+
+    const std::string& text = listeners.textContent;
+
+    if (text.empty()) {
+      return;
+    }
+
+    if (t.tag.TextContent) {
+      t.tag.TextContent(path, text);
+    }
+
+    if (t.tag.TextContentView) {
+      t.tag.TextContentView(path, StringView(text));
+    }
+
+    if (t.tag.TextChunk && !t.tag.TextContent && !t.tag.TextContentView) {
+      t.tag.TextChunk(path, StringView(text), true, true);
+    }
+  }
+
+  void ExpatFacade::EndText(PathListeners& listeners) {
+    for (auto& i : listeners.tags) {
+      i.streaming = false;
+    }
+
+    listeners.textContent.clear();
+    listeners.textLength = 0;
+  }
+
+  void ExpatFacade::StreamText(PathListeners& listeners, StringView chunk) {
+    bool buffer = false;
+
+    for (auto& i : listeners.tags) {
+      if (i.finished) {
+        continue;
+      }
+
+      if (!i.tag.TextChunk) {
+        buffer = buffer || i.tag.WantsText();
+        continue;
+      }
+
+      currentPath_.instance = i.instanceCount;
+
+      if (i.streaming) {
+        i.tag.TextChunk(currentPath_, chunk, false, false);
+      }
+      else if (listeners.textLength > i.tag.streamThreshold) {
+        // Switching to streaming: anything accumulated so far goes out first
+        // (while this listener was buffering the buffer holds the whole run)
+        i.streaming = true;
+
+        if (!listeners.textContent.empty()) {
+          i.tag.TextChunk(currentPath_, StringView(listeners.textContent), true, false);
+        }
+
+        i.tag.TextChunk(currentPath_, chunk, listeners.textContent.empty(), false);
+      }
+      else {
+        buffer = true;
+      }
+    }
+
+    if (buffer) {
+      listeners.textContent.append(chunk.data(), chunk.size());
+    }
+    else {
+      listeners.textContent.clear();
+    }
   }
 
   void ExpatFacade::StartElement(const char *name, const char **atts) {
     // Step 1: Flush any accumulated text content for the parent tag
     //
-    for (auto i = matchedTags_.first; i != matchedTags_.second; ++i) {
-      if (i->second.tag.TextContent && i->second.textContent.length() > 0) {
-        i->second.tag.TextContent(currentPath_, i->second.textContent);
+    PathListeners* parent = stack_.back().listeners;
+
+    if (parent && parent->textLength > 0) {
+      for (auto& i : parent->tags) {
+        if (!i.finished) {
+          DispatchText(i, currentPath_, *parent);
+        }
       }
-      i->second.textContent.clear();
+      EndText(*parent);
     }
 
     // Step 2: update the current Path to reflect the new tage
+    //         (a root element starts a new document, whose attribute name
+    //         pointers are unrelated to the last one's)
     //
-    currentPath_.name = name;
-    currentPath_.path += std::string("/") + name;
+    if (stack_.size() == 1) {
+      attributeIndex_.NewDocument();
+    }
+
+    Frame frame;
+    frame.nameOffset = pathBuffer_.size();
+
+    pathBuffer_.push_back('/');
+    pathBuffer_.append(name);
+
+    UpdatePath(frame.nameOffset);
     currentPath_.depth++;
 
     // Step 3: find the interested tag listeners
     //
-    matchedTags_ = tags_.equal_range(currentPath_.path);
+    frame.hash = HashPath(stack_.back().hash, name);
+    frame.listeners = FindListeners(frame.hash, currentPath_.path);
+    stack_.push_back(frame);
+
+    // Step 4: pass the element on to the subtree consumers of its ancestors
+    //
+    for (auto& i : subtrees_) {
+      i.first->StartElement(name, atts);
+    }
 
-    // Step 4: dispatch the TagOpened event
+    // Step 5: dispatch the TagOpened event
+    //         (or, if nothing is listening at or below this element, have the
+    //         parser skip straight to its end tag)
     //
-    Attributes attributes(atts);
+    if (!frame.listeners) {
+      if (subtrees_.empty()) {
+        SkipSubtree();
+      }
+      return;
+    }
+
+    Attributes attributes(atts, &attributeIndex_);
+
+    for (auto& i : frame.listeners->tags) {
+      if (i.finished) {
+        continue;
+      }
 
-    for (auto i = matchedTags_.first; i != matchedTags_.second; ++ i) {
-      currentPath_.instance = ++ i->second.instanceCount;
+      currentPath_.instance = ++ i.instanceCount;
 
-      if (i->second.tag.TagOpened) {
-        i->second.tag.TagOpened(currentPath_, attributes);
+      if (i.tag.TagOpened) {
+        i.tag.TagOpened(currentPath_, attributes);
+      }
+
+      if (i.tag.subtreeConsumer) {
+        subtrees_.push_back(std::make_pair(i.tag.subtreeConsumer, currentPath_.depth));
+        i.tag.subtreeConsumer->StartElement(name, atts);
       }
     }
   }
@@ -67,50 +588,117 @@ namespace james {
     //
     currentPath_.name = name;
 
-    // Step 2: find interested tag listeners & dispatch events
+    // Step 2: pass the end on to the subtree consumers, closing those started
+    //         for this element
     //
-    matchedTags_ = tags_.equal_range(currentPath_.path);
-    
-    for (auto i = matchedTags_.first; i != matchedTags_.second; ++i) {
-      currentPath_.instance = i->second.instanceCount;
+    for (auto& i : subtrees_) {
+      i.first->EndElement(name);
+    }
 
-      // Step 2a: dispatch any pending text content & clear the buffer
-      //
-      if (i->second.tag.TextContent && i->second.textContent.length() > 0) {
-        i->second.tag.TextContent(currentPath_, i->second.textContent);
-        i->second.textContent.clear();
-      }
+    while (!subtrees_.empty() && subtrees_.back().second == currentPath_.depth) {
+      subtrees_.pop_back();
+    }
+
+    // Step 3: dispatch events to the interested tag listeners
+    //
+    bool stop = false;
 
-      // Step 2b: dispatch the closed event
-      //
-      if (i->second.tag.TagClosed) {
-        i->second.tag.TagClosed(currentPath_);
+    if (PathListeners* listeners = stack_.back().listeners) {
+      for (auto& i : listeners->tags) {
+        if (i.finished) {
+          continue;
+        }
+
+        currentPath_.instance = i.instanceCount;
+
+        // Step 3a: dispatch any pending text content
+        //
+        if (listeners->textLength > 0) {
+          DispatchText(i, currentPath_, *listeners);
+        }
+
+        // Step 3b: dispatch the closed event
+        //
+        if (i.tag.TagClosed) {
+          i.tag.TagClosed(currentPath_);
+        }
+
+        // Step 3c: retire the listener if it has seen all the instances it wants
+        //
+        stop = Finished(i) || stop;
       }
+
+      EndText(*listeners);
+    }
+
+    if (stop && AllFinished()) {
+      StopParser();
     }
 
-    // Step 3: calculate the parent path details
+    // Step 4: calculate the parent path details
+    //         (the parent's listeners are already on the stack)
     //
-    currentPath_.path.erase(currentPath_.path.length() - strlen(name) - 1);
+    pathBuffer_.resize(stack_.back().nameOffset);
+    stack_.pop_back();
+
+    UpdatePath(stack_.back().nameOffset);
     currentPath_.depth--;
+  }
 
-    // 'If' Required because when EndElement is called for the root element,
-    // the path will be empty as the root tag will just have been erased.
-    if (currentPath_.path.size() > 0) {
-      currentPath_.name = currentPath_.path.substr(currentPath_.path.find_last_of('/')+1);
+  bool ExpatFacade::Finished(TagData& t) {
+    const int limit = t.tag.maxInstances > 0 ? t.tag.maxInstances : (stopWhenAllFired_ ? 1 : 0);
+
+    if (limit > 0 && t.instanceCount >= limit) {
+      t.finished = true;
     }
 
-    // Step 4: find any tag listeners interested in the new path
-    //
-    matchedTags_ = tags_.equal_range(currentPath_.path);
+    return t.finished;
   }
 
-  void ExpatFacade::CharacterData(const XML_Char *s, int len) {
-    for (auto i = matchedTags_.first; i != matchedTags_.second; ++i) {
-      // Only store text if the tag listener is interested in it...
-      if (i->second.tag.TextContent) {
-        i->second.textContent.append(s, len);
+  bool ExpatFacade::AllFinished() const {
+    for (auto& p : paths_) {
+      for (auto& t : p.tags) {
+        if (!t.finished) {
+          return false;
+        }
       }
     }
+    return true;
+  }
+
+  void ExpatFacade::UpdatePath(std::size_t nameOffset) {
+    // The views are rebuilt after every change because appending to the buffer
+    // may move it. Once the root element has closed the path & name are both empty.
+    currentPath_.path = StringView(pathBuffer_);
+
+    if (!pathBuffer_.empty()) {
+      currentPath_.name = StringView(pathBuffer_.data() + nameOffset + 1, pathBuffer_.size() - nameOffset - 1);
+    }
+    else {
+      currentPath_.name = StringView();
+    }
+  }
+
+  void ExpatFacade::CharacterData(const XML_Char *s, int len) {
+    for (auto& i : subtrees_) {
+      i.first->CharacterData(s, len);
+    }
+
+    PathListeners* listeners = stack_.back().listeners;
+
+    // Only store text if a tag listener is interested in it...
+    if (!listeners || !listeners->wantsText) {
+      return;
+    }
+
+    listeners->textLength += len;
+
+    if (listeners->streamsText) {
+      StreamText(*listeners, StringView(s, len));
+    }
+    else {
+      listeners->textContent.append(s, len);
+    }
   }
 
 } // james
\ No newline at end of file
@@ -1,14 +1,23 @@
 #pragma once
 
 #include <james/expat-parser.hpp>
+#include <james/expat-name-table.hpp>
+#include <james/expat-string-view.hpp>
+#include <climits>
+#include <cstring>
+#include <deque>
 #include <functional>
-#include <map>
+#include <memory>
+#include <utility>
+#include <vector>
 
 namespace james {
 
+  // name & path are views into ExpatFacade's path buffer, so they are only valid for
+  // the duration of the callback they are passed to.
   struct Path {
-    std::string name;
-    std::string path;
+    StringView name;
+    StringView path;
     int depth;
     int instance;
 
@@ -23,6 +32,77 @@ namespace james {
     Attribute(const char* name, const char* value) : name(name), value(value) {}
   };
 
+  // An attribute name interned ahead of time with ExpatFacade::InternAttribute.
+  // Looking an attribute up by key compares integer ids rather than strings.
+  struct AttrKey {
+    const NameTable* names;
+    int id;
+
+    AttrKey() : names(nullptr), id(NameTable::NOT_FOUND) {}
+    AttrKey(const NameTable* names, int id) : names(names), id(id) {}
+  };
+
+  // One entry in a table of names for Attributes::GetEnum, e.g.
+  //
+  //   static const EnumName<Colour> COLOURS[] = { { "red", RED }, { "green", GREEN } };
+  //
+  template <typename T>
+  struct EnumName {
+    const char* name;
+    T value;
+  };
+
+  namespace detail {
+    // Each parses the whole of s (no leading or trailing space) & returns false if it
+    // isn't a valid value, leaving value untouched
+    bool ParseInteger(const char* s, long long min, long long max, long long& value);
+    bool ParseDouble(const char* s, double& value);
+    bool ParseBool(const char* s, bool& value);
+  }
+
+  // Scratch space for the index Attributes builds on elements with many attributes.
+  // It belongs to whatever creates the Attributes (ExpatFacade keeps one) and is
+  // reused from one element to the next, so indexing never allocates & costs nothing
+  // for elements whose attributes aren't looked up by name.
+  //
+  // It also remembers the AttrKey id of every attribute name seen in the current
+  // document, keyed on the name pointer Expat passes. Expat interns attribute names
+  // (without namespace processing, as ExpatParser always is), so a given name has the
+  // same pointer until the parser moves on to the next document & looking up the key
+  // ids of an element's attributes takes a pointer compare per attribute. Call
+  // NewDocument() before each document; ExpatFacade does so at each root element.
+  struct AttributeIndex {
+    AttributeIndex() : data(nullptr), keyNames(nullptr), keyNamesSize(0), cacheNames(nullptr), cacheNamesSize(0), cacheCount(0) {}
+
+    void NewDocument();
+
+  private:
+    friend struct Attributes;
+
+    // The index has room for SIZE / 2 attributes; beyond that lookups scan
+    static const std::size_t SIZE = 64;
+
+    const char** data;               // The attributes slots was built for, if any
+    unsigned char slots[SIZE];       // Attribute number + 1, 0 for an empty slot
+    const NameTable* keyNames;       // The table keys came from, if any
+    std::size_t keyNamesSize;        // & its size at the time
+    int keys[SIZE / 2];              // Id of each attribute's name in keyNames
+
+    struct CachedName {
+      const char* name;              // Expat's pointer, nullptr for an empty slot
+      int id;
+    };
+
+    // Open addressed; ids are from cacheNames while it had cacheNamesSize names (so
+    // keys created since are picked up by starting again)
+    std::vector<CachedName> cache;
+    const NameTable* cacheNames;
+    std::size_t cacheNamesSize;
+    std::size_t cacheCount;
+
+    int KeyId(const NameTable& names, const char* name);
+  };
+
   struct Attributes {
 
     struct Iterator {
@@ -40,20 +120,74 @@ namespace james {
       const char** data_;
     };
 
-    explicit Attributes(const char** data);
+    // index is optional scratch space for speeding up lookups by name (see
+    // AttributeIndex); it must not be shared with another live Attributes
+    explicit Attributes(const char** data, AttributeIndex* index = nullptr);
 
     const char* operator[] (const char* name) const {
-      for (std::size_t i = 0; data_[i]; i += 2) {
-        if (strcmp(data_[i], name) == 0) {
-          return data_[i + 1];
-        }
-      }
-      return "";
+      const int i = Find(name);
+      return i >= 0 ? data_[2 * i + 1] : "";
     }
 
     bool Has(const char* name) const {
-      for (std::size_t i = 0; data_[i]; i += 2) {
-        if (strcmp(data_[i], name) == 0) {
+      return Find(name) >= 0;
+    }
+
+    // With an AttributeIndex the first lookup by key finds the id of every attribute
+    // name (once per element, from the index's cache of Expat's name pointers); after
+    // that each lookup is a scan over the ids. Without one it's a scan with strcmp.
+    const char* operator[] (const AttrKey& key) const {
+      const int i = Find(key);
+      return i >= 0 ? data_[2 * i + 1] : "";
+    }
+
+    bool Has(const AttrKey& key) const {
+      return Find(key) >= 0;
+    }
+
+    // Typed accessors, taking either a name or an AttrKey. Each converts the value in
+    // place (no std::string, no exceptions) & returns false, leaving value as it was,
+    // when the attribute is missing or its value isn't valid for the type (including
+    // integers out of range). Doubles must match the xs:double lexical form (so no
+    // hex, spaces or "nan(...)") whatever the current locale, & fail if too large for
+    // a double (tiny values round towards 0); booleans are as xs:boolean ("true",
+    // "false", "1" or "0").
+    template <typename Key>
+    bool GetInt(const Key& key, int& value) const {
+      long long v;
+      if (!GetInteger(key, INT_MIN, INT_MAX, v)) {
+        return false;
+      }
+      value = (int) v;
+      return true;
+    }
+
+    template <typename Key>
+    bool GetInt(const Key& key, long long& value) const {
+      return GetInteger(key, LLONG_MIN, LLONG_MAX, value);
+    }
+
+    template <typename Key>
+    bool GetDouble(const Key& key, double& value) const {
+      const char* s = Value(key);
+      return s && detail::ParseDouble(s, value);
+    }
+
+    template <typename Key>
+    bool GetBool(const Key& key, bool& value) const {
+      const char* s = Value(key);
+      return s && detail::ParseBool(s, value);
+    }
+
+    template <typename Key, typename T, std::size_t N>
+    bool GetEnum(const Key& key, const EnumName<T> (&names)[N], T& value) const {
+      const char* s = Value(key);
+      if (!s) {
+        return false;
+      }
+      for (std::size_t i = 0; i < N; ++i) {
+        if (strcmp(names[i].name, s) == 0) {
+          value = names[i].value;
           return true;
         }
       }
@@ -61,18 +195,39 @@ namespace james {
     }
 
     std::size_t Length() const {
-      std::size_t i = 0;
-      while (data_[i]) {
-        i += 2;
-      }
-      return i >> 1;
+      return length_;
     }
 
     friend Iterator begin(const Attributes&);
     friend Iterator end(const Attributes&);
 
   private:
+    // Elements with more attributes than INDEX_THRESHOLD get a small hash index (when
+    // given an AttributeIndex to keep it in), built by the first lookup, so reading
+    // each of n attributes by name costs O(n) rather than O(n^2) string compares
+    static const std::size_t INDEX_THRESHOLD = 8;
+
     const char** data_;
+    std::size_t length_;
+    AttributeIndex* index_;
+
+    int Find(const char* name) const;
+    int Find(const AttrKey& key) const;
+
+    template <typename Key>
+    const char* Value(const Key& key) const {
+      const int i = Find(key);
+      return i >= 0 ? data_[2 * i + 1] : nullptr;
+    }
+
+    template <typename Key>
+    bool GetInteger(const Key& key, long long min, long long max, long long& value) const {
+      const char* s = Value(key);
+      return s && detail::ParseInteger(s, min, max, value);
+    }
+
+    void BuildIndex() const;
+    bool Indexable() const { return index_ && length_ <= AttributeIndex::SIZE / 2; }
   };
 
   struct ExpatFacade;
@@ -81,14 +236,60 @@ namespace james {
     typedef std::function<void(const Path&, const Attributes&)> TagOpenedFunc;
     typedef std::function<void(const Path&)> TagClosedFunc;
     typedef std::function<void(const Path&, const std::string&)> TextContentFunc;
+    typedef std::function<void(const Path&, StringView)> TextContentViewFunc;
+    typedef std::function<void(const Path&, StringView chunk, bool first, bool last)> TextChunkFunc;
 
     TagOpenedFunc TagOpened;
     TagClosedFunc TagClosed;
     TextContentFunc TextContent;
+    TextContentViewFunc TextContentView;
+    TextChunkFunc TextChunk;
+    ExpatParser::XMLConsumer* subtreeConsumer;
+    std::shared_ptr<ExpatParser::XMLConsumer> subtreeOwner;
+    std::size_t streamThreshold;
+    int maxInstances;
+
+    Tag() : subtreeConsumer(nullptr), streamThreshold(0), maxInstances(0) {}
 
     Tag& Opened(TagOpenedFunc f) { TagOpened = f; return *this; }
     Tag& Closed(TagClosedFunc f) { TagClosed = f; return *this; }
     Tag& Text(TextContentFunc f) { TextContent = f; return *this; }
+
+    // As Text() but the text is passed as a view of the facade's buffer, so it is
+    // only valid until the callback returns.
+    Tag& TextView(TextContentViewFunc f) { TextContentView = f; return *this; }
+
+    // Streams text to f in the chunks Expat produces instead of accumulating it, so
+    // huge text nodes don't have to fit in memory. Each run of text ends with a call
+    // where last is true and the chunk is empty.
+    //
+    // With a non-zero threshold text is accumulated as usual (and passed to Text() or
+    // TextView(), or to f as a single chunk) unless a run grows beyond threshold
+    // bytes, at which point it switches to streaming to f.
+    Tag& TextChunks(TextChunkFunc f, std::size_t threshold = 0) {
+      TextChunk = f;
+      streamThreshold = threshold;
+      return *this;
+    }
+
+    // The listener is finished with once this many instances of the tag have closed:
+    // it receives no further events, and when every listener is finished the facade
+    // stops the parser (see ExpatFacade::StopWhenAllFired).
+    Tag& StopAfter(int instances) { maxInstances = instances; return *this; }
+
+    // Passes the element's StartElement, CharacterData & EndElement events, and those
+    // of everything inside it, straight on to consumer (see SubtreeCapture). The
+    // consumer must outlive the facade's use of the tag.
+    Tag& Subtree(ExpatParser::XMLConsumer& consumer) { subtreeConsumer = &consumer; return *this; }
+
+    // As above, but the tag (& so the facade it's registered with) keeps consumer alive
+    Tag& Subtree(std::shared_ptr<ExpatParser::XMLConsumer> consumer) {
+      subtreeConsumer = consumer.get();
+      subtreeOwner = consumer;
+      return *this;
+    }
+
+    bool WantsText() const { return TextContent || TextContentView || TextChunk; }
   };
 
   struct ExpatFacade
@@ -99,22 +300,96 @@ namespace james {
 
     ExpatParser::XMLConsumer& XMLConsumer() { return *this; }
 
+    // Must be called between documents, not from a listener: the facade iterates over
+    // the listeners while an element is open, and adding one may reallocate them.
     void ListenFor(const std::string&, const Tag&);
 
+    // The element being processed, e.g. so a subtree consumer (see Tag::Subtree) can
+    // tell how deep it is. Valid in the same way as the Path passed to callbacks.
+    const Path& CurrentPath() const { return currentPath_; }
+
+    // The depth (as in Path::depth) of the elements path matches, read the same way
+    // ListenFor() reads it (so "a/b", "/a/b" & "/a/b/" are all 2)
+    static int PathDepth(const std::string& path);
+
+    // Interns an attribute name for fast lookups in Attributes (see AttrKey). Keys are
+    // best created up front: one created while parsing still works but makes the next
+    // lookup start the document's cache of attribute names over.
+    AttrKey InternAttribute(const char* name) { return AttrKey(&attributeNames_, attributeNames_.Intern(name)); }
+
+    // Treats every listener without a StopAfter() limit as finished after its first
+    // instance, so parsing stops as soon as each registered path has been seen.
+    void StopWhenAllFired(bool stop = true) { stopWhenAllFired_ = stop; }
+
+    // Forgets the current document (open elements, pending text, instance counts &
+    // finished listeners) so the facade can be used for another one, e.g. after the
+    // parser was stopped early or threw. Registered listeners are kept.
+    void Reset();
+
   private:
     struct TagData {
       Tag tag;
-      std::string textContent;
       int instanceCount;
+      bool streaming;  // Streaming the current run of text to tag.TextChunk
+      bool finished;
 
-      TagData(const Tag& tag) : tag(tag), instanceCount(0) {}
+      TagData(const Tag& tag) : tag(tag), instanceCount(0), streaming(false), finished(false) {}
     };
 
-    typedef std::multimap<std::string, TagData> TagMap;
+    // All the listeners for one path. Text is accumulated once per path (rather than
+    // once per listener) and every listener is handed the same buffer. The buffer is
+    // left empty when every listener interested in text is streaming it.
+    struct PathListeners {
+      std::string path;
+      std::size_t hash;
+      std::vector<TagData> tags;
+      std::string textContent;
+      std::size_t textLength;  // Length of the current run of text, buffered or not
+      bool wantsText;
+      bool streamsText;
 
-    TagMap tags_;
-    std::pair<TagMap::iterator, TagMap::iterator> matchedTags_;
+      PathListeners() : hash(0), textLength(0), wantsText(false), streamsText(false) {}
+    };
+
+    // Listeners are found through a flat open addressed table keyed on a hash of the
+    // path. The hash of a child path is computed from its parent's hash & the element
+    // name (see HashPath), so looking up an element costs the same whatever its depth
+    // & however many paths are registered.
+    //
+    // The stack holds the hash & listeners for each open element, along with where
+    // the element's "/name" starts in pathBuffer_. The buffer only ever grows to the
+    // length of the deepest path so maintaining it doesn't allocate once warmed up.
+    struct Frame {
+      std::size_t hash;
+      PathListeners* listeners;
+      std::size_t nameOffset;
+    };
+
+    std::deque<PathListeners> paths_;
+    std::vector<int> index_;  // Indexes into paths_, -1 for an empty slot
+    std::vector<Frame> stack_;
+    std::string pathBuffer_;
     Path currentPath_;
+    bool stopWhenAllFired_;
+    NameTable attributeNames_;
+    AttributeIndex attributeIndex_;
+
+    // Subtree consumers of the open elements (see Tag::Subtree) & the depth of the
+    // element each one was started for. Nothing is skipped while any are open.
+    std::vector<std::pair<ExpatParser::XMLConsumer*, int>> subtrees_;
+
+    static std::size_t HashPath(std::size_t parentHash, const char* name);
+    PathListeners* FindListeners(std::size_t hash, StringView path);
+    PathListeners* AddPath(std::size_t hash, const std::string& path);
+    void UpdatePath(std::size_t nameOffset);
+
+    void StreamText(PathListeners&, StringView chunk);
+    static void DispatchText(TagData&, const Path&, const PathListeners&);
+    static void EndText(PathListeners&);
+
+    bool Finished(TagData&);
+    bool AllFinished() const;
+    void RebuildIndex();
 
     void StartElement(const char *name, const char **atts) override;
     void EndElement(const char *name) override;
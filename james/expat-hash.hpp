@@ -0,0 +1,22 @@
+#pragma once
+
+#include <cstddef>
+
+namespace james {
+
+  // FNV-1a, as used by the name, path & attribute hash tables. It works left to
+  // right, so a hash can be continued over more characters by passing it back in.
+  const std::size_t FNV_OFFSET_BASIS = 2166136261u;
+
+  inline std::size_t HashChar(std::size_t h, char c) {
+    return (h ^ (unsigned char) c) * 16777619u;
+  }
+
+  inline std::size_t HashString(const char* s, std::size_t h = FNV_OFFSET_BASIS) {
+    for (; *s; ++s) {
+      h = HashChar(h, *s);
+    }
+    return h;
+  }
+
+} // james
@@ -0,0 +1,75 @@
+#include "expat-name-table.hpp"
+#include "expat-hash.hpp"
+
+#include <cstring>
+
+namespace james {
+
+  const int NameTable::NOT_FOUND;
+
+  NameTable::NameTable()
+    : slots_(16, NOT_FOUND)
+  {
+  }
+
+  size_t NameTable::Hash(const char* name) {
+    return HashString(name);
+  }
+
+  size_t NameTable::FindSlot(const char* name, size_t hash) const {
+    const size_t mask = slots_.size() - 1;
+    size_t i = hash & mask;
+
+    while (slots_[i] != NOT_FOUND) {
+      const int id = slots_[i];
+      if (hashes_[id] == hash && strcmp(names_[id].c_str(), name) == 0) {
+        break;
+      }
+      i = (i + 1) & mask;
+    }
+
+    return i;
+  }
+
+  int NameTable::Find(const char* name) const {
+    return slots_[FindSlot(name, Hash(name))];
+  }
+
+  int NameTable::Intern(const char* name) {
+    const size_t hash = Hash(name);
+    size_t slot = FindSlot(name, hash);
+
+    if (slots_[slot] != NOT_FOUND) {
+      return slots_[slot];
+    }
+
+    // Keep the load factor under 1/2 so probe sequences stay short
+    if ((names_.size() + 1) * 2 > slots_.size()) {
+      Grow();
+      slot = FindSlot(name, hash);
+    }
+
+    const int id = (int) names_.size();
+    names_.push_back(name);
+    hashes_.push_back(hash);
+    slots_[slot] = id;
+
+    return id;
+  }
+
+  void NameTable::Grow() {
+    std::vector<int> slots(slots_.size() * 2, NOT_FOUND);
+    const size_t mask = slots.size() - 1;
+
+    for (size_t id = 0; id < names_.size(); ++id) {
+      size_t i = hashes_[id] & mask;
+      while (slots[i] != NOT_FOUND) {
+        i = (i + 1) & mask;
+      }
+      slots[i] = (int) id;
+    }
+
+    slots_.swap(slots);
+  }
+
+} // james
@@ -0,0 +1,38 @@
+#pragma once
+
+#include <string>
+#include <vector>
+
+namespace james {
+
+  //
+  // Interns names (element names, attribute names...) as small integer ids.
+  //
+  // Find() looks a name up straight from the const char* Expat hands us, without
+  // building a std::string, so it never allocates.
+  //
+  struct NameTable {
+    static const int NOT_FOUND = -1;
+
+    NameTable();
+
+    int Intern(const char* name);
+    int Intern(const std::string& name) { return Intern(name.c_str()); }
+
+    int Find(const char* name) const;
+
+    const std::string& Name(int id) const { return names_[id]; }
+    size_t Size() const { return names_.size(); }
+
+  private:
+    std::vector<std::string> names_;
+    std::vector<size_t> hashes_;
+    std::vector<int> slots_;  // Open addressed; NOT_FOUND marks an empty slot
+
+    static size_t Hash(const char* name);
+
+    size_t FindSlot(const char* name, size_t hash) const;
+    void Grow();
+  };
+
+} // james
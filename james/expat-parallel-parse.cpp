@@ -0,0 +1,414 @@
+#include "expat-parallel-parse.hpp"
+#include "expat-util.hpp"
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+namespace james {
+
+  namespace {
+    // Expat takes lengths as an int, so chunks are fed to it in slices of this size
+    const size_t MAX_PARSE_LENGTH = 16 * 1024 * 1024;
+
+    // How many chunks (per thread) workers may get ahead of the chunk waiting to be
+    // delivered in ordered mode, which bounds the results held in memory
+    const size_t ORDERED_WINDOW = 4;
+
+    // The whole file: mapped where possible, otherwise read into memory
+    struct FileContents {
+      const char* data;
+      size_t size;
+
+      explicit FileContents(const std::string& path);
+      ~FileContents();
+
+      FileContents(const FileContents&) = delete;
+      FileContents& operator =(const FileContents&) = delete;
+
+    private:
+    #ifdef JAMES_HAVE_MMAP
+      void* mapping_;
+    #else
+      std::string contents_;
+    #endif
+    };
+
+    #ifdef JAMES_HAVE_MMAP
+
+    FileContents::FileContents(const std::string& path)
+      : data(""), size(0), mapping_(MAP_FAILED)
+    {
+      detail::FileDescriptor file(open(path.c_str(), O_RDONLY));
+
+      if (file.fd < 0) {
+        throw std::runtime_error("Unable to open " + path + " (open failed)");
+      }
+
+      struct stat info;
+      if (fstat(file.fd, &info) != 0) {
+        throw std::runtime_error("Unable to read the size of " + path + " (fstat failed)");
+      }
+
+      if (info.st_size > 0) {
+        mapping_ = mmap(nullptr, (size_t) info.st_size, PROT_READ, MAP_PRIVATE, file.fd, 0);
+
+        if (mapping_ == MAP_FAILED) {
+          throw std::runtime_error("Unable to map " + path + " (mmap failed)");
+        }
+
+        data = static_cast<const char*>(mapping_);
+        size = (size_t) info.st_size;
+      }
+    }
+
+    FileContents::~FileContents() {
+      if (mapping_ != MAP_FAILED) {
+        munmap(mapping_, size);
+      }
+    }
+
+    #else
+
+    FileContents::FileContents(const std::string& path)
+      : data(""), size(0)
+    {
+      std::ifstream src(path, std::ios::in | std::ios::binary);
+
+      if (!src) {
+        throw std::runtime_error("Unable to open " + path);
+      }
+
+      contents_.assign(std::istreambuf_iterator<char>(src), std::istreambuf_iterator<char>());
+      data = contents_.data();
+      size = contents_.size();
+    }
+
+    FileContents::~FileContents() {
+    }
+
+    #endif
+
+    const char* Find(const char* begin, const char* end, const char* s) {
+      return std::search(begin, end, s, s + strlen(s));
+    }
+
+    // Past the closing sequence found by Find, or end if there wasn't one
+    const char* Skip(const char* begin, const char* end, const char* s) {
+      const char* found = Find(begin, end, s);
+      return found == end ? end : found + strlen(s);
+    }
+
+    // Past the '>' ending the markup that starts at p, ignoring any in quoted values
+    const char* EndOfTag(const char* p, const char* end) {
+      char quote = 0;
+
+      for (; p < end; ++p) {
+        if (quote) {
+          quote = *p == quote ? 0 : quote;
+        }
+        else if (*p == '"' || *p == '\'') {
+          quote = *p;
+        }
+        else if (*p == '>') {
+          return p + 1;
+        }
+      }
+
+      return end;
+    }
+
+    // The root element's start tag, found by skipping the XML declaration, processing
+    // instructions, comments & any DOCTYPE (including its internal subset)
+    const char* FindRootStart(const char* p, const char* end) {
+      while ((p = std::find(p, end, '<')) < end) {
+        if (end - p >= 2 && p[1] == '?') {
+          p = Skip(p + 2, end, "?>");
+        }
+        else if (end - p >= 4 && memcmp(p, "<!--", 4) == 0) {
+          p = Skip(p + 4, end, "-->");
+        }
+        else if (end - p >= 2 && p[1] == '!') {
+          int brackets = 0;
+          char quote = 0;
+
+          for (++p; p < end; ++p) {
+            if (quote) {
+              quote = *p == quote ? 0 : quote;
+            }
+            else if (*p == '"' || *p == '\'') {
+              quote = *p;
+            }
+            else if (*p == '[') {
+              brackets++;
+            }
+            else if (*p == ']') {
+              brackets--;
+            }
+            else if (*p == '>' && brackets <= 0) {
+              ++p;
+              break;
+            }
+          }
+        }
+        else {
+          return p;
+        }
+      }
+
+      return end;
+    }
+
+    // Past the first </record> close tag at or after p, or end if there isn't one
+    const char* NextSplit(const char* p, const char* end, const std::string& closeTag) {
+      for (;;) {
+        p = Find(p, end, closeTag.c_str());
+
+        if (p == end) {
+          return end;
+        }
+
+        p += closeTag.size();
+        while (p < end && detail::IsSpace(*p)) {
+          ++p;
+        }
+
+        if (p < end && *p == '>') {
+          return p + 1;
+        }
+      }
+    }
+
+    struct Chunk {
+      const char* begin;
+      const char* end;
+    };
+
+    // What every chunk but the first needs parsing before it (the prolog & root start
+    // tag) and every chunk but the last after it (the root end tag)
+    struct RootContext {
+      std::string prefix;
+      std::string suffix;
+    };
+
+    std::vector<Chunk> SplitRecords(const FileContents& file, const ParallelParseOptions& options, RootContext& root) {
+      const char* const begin = file.data;
+      const char* const end = file.data + file.size;
+
+      std::vector<Chunk> chunks;
+      Chunk first = { begin, end };
+      chunks.push_back(first);
+
+      const char* rootStart = FindRootStart(begin, end);
+      const char* rootEnd = EndOfTag(rootStart, end);
+
+      // Malformed or trivial documents go through in one piece (for Expat to complain
+      // about if need be)
+      if (rootStart == end || rootEnd == end || rootEnd[-2] == '/' || options.recordElement.empty()) {
+        return chunks;
+      }
+
+      const char* name = rootStart + 1;
+      const char* nameEnd = name;
+      while (nameEnd < rootEnd && !detail::IsSpace(*nameEnd) && *nameEnd != '>' && *nameEnd != '/') {
+        ++nameEnd;
+      }
+
+      root.prefix.assign(begin, rootEnd);
+      root.suffix = "</" + std::string(name, nameEnd) + ">";
+
+      const std::string closeTag = "</" + options.recordElement;
+      const size_t chunkSize = std::max(options.chunkSize, (size_t) 1);
+
+      while ((size_t) (end - chunks.back().begin) > chunkSize) {
+        const char* split = NextSplit(std::max(chunks.back().begin + chunkSize, rootEnd), end, closeTag);
+
+        if (split == end) {
+          break;
+        }
+
+        chunks.back().end = split;
+
+        Chunk next = { split, end };
+        chunks.push_back(next);
+      }
+
+      return chunks;
+    }
+
+    void Parse(ExpatParser& parser, const char* data, size_t length) {
+      while (length > 0 && !parser.Stopped()) {
+        const size_t slice = std::min(length, MAX_PARSE_LENGTH);
+        parser.Parse(data, slice, false);
+        data += slice;
+        length -= slice;
+      }
+    }
+
+    struct ChunkResult {
+      ChunkDeliverFunc deliver;
+      std::exception_ptr error;
+      bool done;
+
+      ChunkResult() : done(false) {}
+    };
+  }
+
+  void ParallelParseFile(const std::string& path, const ParallelParseOptions& options, const ChunkListenFunc& listen) {
+    FileContents file(path);
+    RootContext root;
+    const std::vector<Chunk> chunks(SplitRecords(file, options, root));
+
+    unsigned threadCount = options.threads ? options.threads : std::thread::hardware_concurrency();
+    threadCount = (unsigned) std::min((size_t) std::max(threadCount, 1u), chunks.size());
+
+    const size_t window = ORDERED_WINDOW * threadCount;
+
+    std::vector<ChunkResult> results(chunks.size());
+    std::deque<size_t> finished;  // In the order they finished
+    size_t next = 0;
+    size_t delivered = 0;
+    bool cancelled = false;
+
+    std::mutex mutex;
+    std::condition_variable chunkDone;
+    std::condition_variable chunkDelivered;
+
+    auto worker = [&]() {
+      // Each worker reuses one parser; it's created with the first chunk's consumer
+      std::unique_ptr<ExpatParser> parser;
+
+      for (;;) {
+        size_t i;
+
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          chunkDelivered.wait(lock, [&]() {
+            return cancelled || next >= chunks.size() || !options.ordered || next < delivered + window;
+          });
+
+          if (cancelled || next >= chunks.size()) {
+            return;
+          }
+
+          i = next++;
+        }
+
+        ChunkResult result;
+
+        try {
+          ExpatFacade facade;
+
+          // The parser is kept for the next chunk, so unbind it before facade goes
+          struct Unbind {
+            std::unique_ptr<ExpatParser>& parser;
+            ~Unbind() { if (parser) { parser->Unbind(); } }
+          } unbind = { parser };
+
+          result.deliver = listen(facade);
+
+          if (parser) {
+            parser->Reset(facade.XMLConsumer());
+          }
+          else {
+            parser.reset(new ExpatParser(facade.XMLConsumer()));
+          }
+
+          const bool last = i + 1 == chunks.size();
+
+          if (i > 0) {
+            parser->Parse(root.prefix, false);
+          }
+
+          Parse(*parser, chunks[i].begin, (size_t) (chunks[i].end - chunks[i].begin));
+
+          if (!parser->Stopped()) {
+            parser->Parse(last ? std::string() : root.suffix, true);
+          }
+        }
+        catch (...) {
+          result.error = std::current_exception();
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          result.done = true;
+          results[i] = std::move(result);
+          finished.push_back(i);
+        }
+
+        chunkDone.notify_all();
+      }
+    };
+
+    std::vector<std::thread> threads;
+
+    // Stops & joins the workers however delivery ends
+    struct Join {
+      std::vector<std::thread>& threads;
+      std::mutex& mutex;
+      std::condition_variable& chunkDelivered;
+      bool& cancelled;
+
+      ~Join() {
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          cancelled = true;
+        }
+        chunkDelivered.notify_all();
+
+        for (auto& t : threads) {
+          t.join();
+        }
+      }
+    } join = { threads, mutex, chunkDelivered, cancelled };
+
+    for (unsigned t = 0; t < threadCount; ++t) {
+      threads.push_back(std::thread(worker));
+    }
+
+    for (size_t count = 0; count < chunks.size(); ++count) {
+      ChunkResult result;
+
+      {
+        std::unique_lock<std::mutex> lock(mutex);
+        size_t i = count;
+
+        if (options.ordered) {
+          chunkDone.wait(lock, [&]() { return results[i].done; });
+        }
+        else {
+          chunkDone.wait(lock, [&]() { return !finished.empty(); });
+          i = finished.front();
+          finished.pop_front();
+        }
+
+        result = std::move(results[i]);
+      }
+
+      if (result.error) {
+        std::rethrow_exception(result.error);
+      }
+
+      if (result.deliver) {
+        result.deliver();
+      }
+
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        delivered++;
+      }
+
+      chunkDelivered.notify_all();
+    }
+  }
+
+} // james
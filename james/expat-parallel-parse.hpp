@@ -0,0 +1,47 @@
+#pragma once
+
+#include <james/expat-facade.hpp>
+#include <functional>
+#include <string>
+
+namespace james {
+
+  struct ParallelParseOptions {
+    std::string recordElement;  // Name of the repeated child of the root element
+    unsigned threads;           // 0 for one per hardware thread
+    size_t chunkSize;           // Rough number of bytes handed to a worker at a time
+    bool ordered;               // Deliver chunk results in document order
+
+    explicit ParallelParseOptions(const std::string& recordElement, unsigned threads = 0, size_t chunkSize = 4 * 1024 * 1024, bool ordered = true)
+      : recordElement(recordElement), threads(threads), chunkSize(chunkSize), ordered(ordered)
+    {}
+  };
+
+  // Called on a worker thread with a fresh facade for each chunk. It registers the
+  // listeners for the chunk & returns a function which delivers whatever they
+  // collected; that is called on the thread which called ParallelParseFile once the
+  // chunk has been parsed.
+  typedef std::function<void()> ChunkDeliverFunc;
+  typedef std::function<ChunkDeliverFunc(ExpatFacade&)> ChunkListenFunc;
+
+  //
+  // Parses a document made up of a root element wrapping many independent record
+  // elements, e.g. <root><record/><record/>...</root>, on several threads at once.
+  //
+  // The file is memory mapped & split after a </record> close tag roughly every
+  // chunkSize bytes. Each chunk is parsed by its own ExpatParser & ExpatFacade, with
+  // the prolog (XML declaration, DOCTYPE...) & root start tag parsed ahead of it and
+  // the root end tag after it, so paths are the same as for the whole document.
+  //
+  // Results are delivered in document order when options.ordered is set, otherwise
+  // in whatever order the chunks finish. The first exception from parsing, a
+  // listener or a deliver function stops the remaining work & is rethrown (in
+  // ordered mode, after the chunks before the failing one have been delivered).
+  //
+  // The split points are found by searching for the record's close tag rather than
+  // by parsing, so records must not nest & the close tag must not appear in comments
+  // or CDATA sections. Note that listeners on the root element see it once per chunk.
+  //
+  void ParallelParseFile(const std::string& path, const ParallelParseOptions&, const ChunkListenFunc& listen);
+
+} // james
@@ -0,0 +1,124 @@
+#include "expat-parse-loop.hpp"
+
+#ifdef JAMES_HAVE_EPOLL
+
+#include <algorithm>
+#include <cerrno>
+#include <climits>
+#include <system_error>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+namespace james {
+
+  namespace {
+    // Most events handled per epoll_wait; any more are picked up by the next Poll()
+    const int MAX_EVENTS = 64;
+
+    std::system_error SystemError(const char* what) {
+      return std::system_error(errno, std::system_category(), what);
+    }
+  }
+
+  ExpatParseLoop::ExpatParseLoop(size_t bufferSize)
+    : epoll_(epoll_create1(EPOLL_CLOEXEC)), bufferSize_(std::min(std::max(bufferSize, (size_t) 1), (size_t) INT_MAX))
+  {
+    if (epoll_ < 0) {
+      throw SystemError("Unable to create ExpatParseLoop (epoll_create1 failed)");
+    }
+  }
+
+  ExpatParseLoop::~ExpatParseLoop() {
+    close(epoll_);
+  }
+
+  void ExpatParseLoop::Add(int fd, ExpatParser& parser, CompletionFunc done) {
+    std::unique_ptr<Stream> stream(new Stream());
+    stream->fd = fd;
+    stream->parser = &parser;
+    stream->done = done;
+
+    epoll_event event = {};
+    event.events = EPOLLIN;
+    event.data.ptr = stream.get();
+
+    if (epoll_ctl(epoll_, EPOLL_CTL_ADD, fd, &event) != 0) {
+      throw SystemError("Unable to watch descriptor (epoll_ctl failed)");
+    }
+
+    streams_.push_back(std::move(stream));
+  }
+
+  size_t ExpatParseLoop::Poll(int timeoutMs) {
+    if (streams_.empty()) {
+      return 0;
+    }
+
+    epoll_event events[MAX_EVENTS];
+    const int count = epoll_wait(epoll_, events, MAX_EVENTS, timeoutMs);
+
+    if (count < 0) {
+      if (errno == EINTR) {
+        return streams_.size();
+      }
+      throw SystemError("ExpatParseLoop::Poll failed (epoll_wait failed)");
+    }
+
+    for (int i = 0; i < count; ++i) {
+      // Errors & hang ups are reported by read() too, so every event is a read
+      Stream* stream = static_cast<Stream*>(events[i].data.ptr);
+      std::exception_ptr error;
+
+      if (!Read(*stream, error)) {
+        Complete(stream, error);
+      }
+    }
+
+    return streams_.size();
+  }
+
+  void ExpatParseLoop::Run() {
+    while (Poll() > 0) {}
+  }
+
+  bool ExpatParseLoop::Read(Stream& stream, std::exception_ptr& error) {
+    try {
+      char* buffer = static_cast<char*>(stream.parser->GetBuffer(bufferSize_));
+      const ssize_t bytesRead = read(stream.fd, buffer, bufferSize_);
+
+      if (bytesRead < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) {
+          return true;
+        }
+        throw SystemError("Unable to read from descriptor (read failed)");
+      }
+
+      stream.parser->ParseBuffer((size_t) bytesRead, bytesRead == 0);
+
+      return bytesRead > 0 && !stream.parser->Stopped();
+    }
+    catch (...) {
+      error = std::current_exception();
+      return false;
+    }
+  }
+
+  void ExpatParseLoop::Complete(Stream* stream, std::exception_ptr error) {
+    epoll_ctl(epoll_, EPOLL_CTL_DEL, stream->fd, nullptr);
+
+    // Removed before the callback runs so that it may Add() another stream (or even
+    // the same descriptor again)
+    CompletionFunc done;
+    done.swap(stream->done);
+
+    streams_.erase(std::find_if(streams_.begin(), streams_.end(),
+      [=](const std::unique_ptr<Stream>& s) { return s.get() == stream; }));
+
+    if (done) {
+      done(error);
+    }
+  }
+
+} // james
+
+#endif
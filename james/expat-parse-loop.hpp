@@ -0,0 +1,75 @@
+#pragma once
+
+#include <james/expat-parser.hpp>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <vector>
+
+#if defined(__linux__)
+#  define JAMES_HAVE_EPOLL 1
+#endif
+
+#ifdef JAMES_HAVE_EPOLL
+
+namespace james {
+
+  //
+  // Parses many documents arriving on non-blocking file descriptors (sockets, pipes)
+  // from a single thread.
+  //
+  // Each Add()ed descriptor is watched with epoll. Whenever one becomes readable a
+  // single read is made straight into its parser's buffer (see ExpatParser::GetBuffer)
+  // and parsed, so one busy stream can't starve the others. At end of file the
+  // document is finished off and the stream's completion callback is called.
+  //
+  //   ExpatParseLoop loop;
+  //   loop.Add(socket, parser, [](std::exception_ptr error) { ... });
+  //   loop.Run();
+  //
+  // The loop doesn't own the descriptors or the parsers - both must stay alive until
+  // the stream completes. Descriptors should be non-blocking (O_NONBLOCK).
+  //
+  struct ExpatParseLoop {
+    // Called once per stream, from Poll(), after the stream has been removed from the
+    // loop. error is null when the document parsed (or the parser was stopped),
+    // otherwise it holds the ExpatParser::Exception, consumer exception or
+    // std::system_error (for a failed read) which ended the stream.
+    typedef std::function<void(std::exception_ptr error)> CompletionFunc;
+
+    explicit ExpatParseLoop(size_t bufferSize = 64 * 1024);
+    ~ExpatParseLoop();
+
+    ExpatParseLoop(const ExpatParseLoop&) = delete;
+    ExpatParseLoop& operator =(const ExpatParseLoop&) = delete;
+
+    void Add(int fd, ExpatParser& parser, CompletionFunc done);
+
+    // Waits up to timeoutMs (-1 for no limit) for input and parses whatever arrived.
+    // Returns the number of streams still in progress.
+    size_t Poll(int timeoutMs = -1);
+
+    // Polls until every stream has completed
+    void Run();
+
+    size_t ActiveCount() const { return streams_.size(); }
+
+  private:
+    struct Stream {
+      int fd;
+      ExpatParser* parser;
+      CompletionFunc done;
+    };
+
+    int epoll_;
+    size_t bufferSize_;
+    std::vector<std::unique_ptr<Stream>> streams_;
+
+    // Returns false once the stream has finished (successfully or not)
+    bool Read(Stream&, std::exception_ptr& error);
+    void Complete(Stream*, std::exception_ptr error);
+  };
+
+} // james
+
+#endif
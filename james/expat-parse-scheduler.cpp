@@ -0,0 +1,190 @@
+#include "expat-parse-scheduler.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+
+namespace james {
+
+  namespace {
+    struct WorkQueue {
+      std::mutex mutex;
+      std::deque<size_t> documents;
+
+      // The owner works from the front...
+      bool Pop(size_t& document) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (documents.empty()) {
+          return false;
+        }
+        document = documents.front();
+        documents.pop_front();
+        return true;
+      }
+
+      // ...& thieves from the back, so they mostly don't contend
+      bool Steal(size_t& document) {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (documents.empty()) {
+          return false;
+        }
+        document = documents.back();
+        documents.pop_back();
+        return true;
+      }
+    };
+  }
+
+  ParseScheduler::ParseScheduler(ConsumerFactory factory, unsigned threads, RegisteredHandlers handlers)
+    : factory_(factory), threads_(threads ? threads : std::max(std::thread::hardware_concurrency(), 1u)), handlers_(handlers)
+  {
+  }
+
+  size_t ParseScheduler::Add(const Document& document) {
+    documents_.push_back(document);
+    return documents_.size() - 1;
+  }
+
+  size_t ParseScheduler::AddFile(const std::string& path) {
+    Document document;
+    document.name = path;
+    document.parse = [path](ExpatParser& parser) { ParseFile(parser, path); };
+    return Add(document);
+  }
+
+  size_t ParseScheduler::AddBuffer(const std::string& xml, const std::string& name) {
+    auto buffer = std::make_shared<const std::string>(xml);
+
+    Document document;
+    document.name = name;
+    document.parse = [buffer](ExpatParser& parser) { parser.Parse(*buffer); };
+    return Add(document);
+  }
+
+  size_t ParseScheduler::AddStream(std::shared_ptr<std::istream> src, const std::string& name) {
+    Document document;
+    document.name = name;
+    document.parse = [src](ExpatParser& parser) { ParseStream(parser, *src); };
+    return Add(document);
+  }
+
+  std::vector<ParseScheduler::Result> ParseScheduler::Run(Stats* stats) {
+    const auto start(std::chrono::steady_clock::now());
+
+    std::vector<Document> documents;
+    documents.swap(documents_);
+
+    std::vector<Result> results(documents.size());
+    const unsigned threadCount = (unsigned) std::min((size_t) threads_, std::max(documents.size(), (size_t) 1));
+
+    std::vector<std::unique_ptr<WorkQueue>> queues;
+    for (unsigned t = 0; t < threadCount; ++t) {
+      queues.push_back(std::unique_ptr<WorkQueue>(new WorkQueue()));
+    }
+
+    for (size_t d = 0; d < documents.size(); ++d) {
+      queues[d % threadCount]->documents.push_back(d);
+    }
+
+    std::atomic<size_t> steals(0);
+    std::atomic<bool> cancelled(false);
+
+    auto worker = [&](unsigned self) {
+      std::unique_ptr<ExpatParser> parser;
+
+      while (!cancelled) {
+        size_t d;
+
+        // Nothing is added once Run() has started, so when every queue is empty the
+        // work is done
+        if (!queues[self]->Pop(d)) {
+          bool stolen = false;
+
+          for (unsigned i = 1; i < threadCount && !stolen; ++i) {
+            stolen = queues[(self + i) % threadCount]->Steal(d);
+          }
+
+          if (!stolen) {
+            return;
+          }
+
+          steals++;
+        }
+
+        Result& result = results[d];
+        result.name = documents[d].name;
+        result.worker = self;
+
+        const auto parseStart(std::chrono::steady_clock::now());
+
+        try {
+          result.consumer = factory_(documents[d]);
+
+          if (!result.consumer) {
+            throw std::runtime_error("ParseScheduler's consumer factory returned null for " + documents[d].name);
+          }
+
+          if (parser) {
+            parser->Reset(*result.consumer);
+          }
+          else {
+            parser.reset(new ExpatParser(*result.consumer, handlers_));
+          }
+
+          documents[d].parse(*parser);
+        }
+        catch (...) {
+          result.error = std::current_exception();
+        }
+
+        result.elapsed = std::chrono::steady_clock::now() - parseStart;
+      }
+    };
+
+    std::vector<std::thread> threads;
+
+    {
+      // Stops & joins the workers however this scope is left (starting a thread, or
+      // worker 0 itself, may throw)
+      struct Join {
+        std::vector<std::thread>& threads;
+        std::atomic<bool>& cancelled;
+        bool finished;
+
+        ~Join() {
+          cancelled = !finished;
+
+          for (auto& t : threads) {
+            t.join();
+          }
+        }
+      } join = { threads, cancelled, false };
+
+      for (unsigned t = 1; t < threadCount; ++t) {
+        threads.push_back(std::thread(worker, t));
+      }
+
+      // The calling thread is worker 0
+      worker(0);
+      join.finished = true;
+    }
+
+    if (stats) {
+      *stats = Stats();
+      stats->documents = results.size();
+      stats->steals = steals;
+      stats->elapsed = std::chrono::steady_clock::now() - start;
+
+      for (auto& r : results) {
+        stats->failed += r.error ? 1 : 0;
+        stats->parseElapsed += r.elapsed;
+      }
+    }
+
+    return results;
+  }
+
+} // james
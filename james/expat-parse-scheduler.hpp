@@ -0,0 +1,82 @@
+#pragma once
+
+#include <james/expat-parser.hpp>
+#include <chrono>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace james {
+
+  //
+  // Parses a batch of documents (files, in-memory buffers, streams) across a pool of
+  // threads.
+  //
+  // Documents are dealt out round robin to a queue per worker. A worker takes work
+  // from the front of its own queue & when that runs dry steals from the back of the
+  // others', so a few large documents don't leave the other threads idle. Each
+  // worker reuses a single ExpatParser (see ExpatParser::Reset) for all of its
+  // documents.
+  //
+  //   ParseScheduler scheduler([](const ParseScheduler::Document&) {
+  //     return std::unique_ptr<ExpatParser::XMLConsumer>(new MyConsumer());
+  //   });
+  //   scheduler.AddFile("a.xml");
+  //   scheduler.AddFile("b.xml");
+  //   for (auto& r : scheduler.Run()) { ... }
+  //
+  struct ParseScheduler {
+    struct Document {
+      std::string name;
+      std::function<void(ExpatParser&)> parse;  // Feeds the whole document to the parser
+    };
+
+    struct Result {
+      std::string name;
+      std::unique_ptr<ExpatParser::XMLConsumer> consumer;  // As returned by the factory
+      std::exception_ptr error;                            // Null if the document parsed
+      std::chrono::steady_clock::duration elapsed;
+      unsigned worker;
+
+      Result() : elapsed(0), worker(0) {}
+    };
+
+    struct Stats {
+      size_t documents;
+      size_t failed;
+      size_t steals;  // Documents parsed by a worker other than the one they were queued for
+      std::chrono::steady_clock::duration elapsed;       // Wall clock time for Run()
+      std::chrono::steady_clock::duration parseElapsed;  // Summed over the documents
+
+      Stats() : documents(0), failed(0), steals(0), elapsed(0), parseElapsed(0) {}
+    };
+
+    // Called on the worker threads (so it must be thread safe) to create the consumer
+    // for each document
+    typedef std::function<std::unique_ptr<ExpatParser::XMLConsumer>(const Document&)> ConsumerFactory;
+
+    explicit ParseScheduler(ConsumerFactory, unsigned threads = 0, RegisteredHandlers handlers = DEFAULT_HANDLERS_ONLY);
+
+    ParseScheduler(const ParseScheduler&) = delete;
+    ParseScheduler& operator =(const ParseScheduler&) = delete;
+
+    // Each returns the index of the document's Result
+    size_t Add(const Document&);
+    size_t AddFile(const std::string& path);
+    size_t AddBuffer(const std::string& xml, const std::string& name = std::string());
+    size_t AddStream(std::shared_ptr<std::istream>, const std::string& name = std::string());
+
+    // Parses every document added since the last Run() & returns their results in the
+    // order they were added. Failures are reported in the results rather than thrown.
+    std::vector<Result> Run(Stats* stats = nullptr);
+
+  private:
+    ConsumerFactory factory_;
+    unsigned threads_;
+    RegisteredHandlers handlers_;
+    std::vector<Document> documents_;
+  };
+
+} // james
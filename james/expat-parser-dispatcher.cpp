@@ -1,89 +1,107 @@
 #include "expat-parser-dispatcher.hpp"
 
-#include <algorithm>
-#include <iostream>
+#include <cstring>
 
 namespace james {
 
-  namespace {
-    bool ComparePair(const std::pair<std::string, ExpatParserDispatcher::XMLConsumer*>& a, const std::pair<std::string, ExpatParserDispatcher::XMLConsumer*>& b) {
-      return a.first < b.first;
-    }
+  const int ExpatParserDispatcher::NO_STATE;
+
+  ExpatParserDispatcher::ExpatParserDispatcher()
+    : states_(1)
+  {
+    // State 0 is the document itself (i.e. outside the root element)
+    Frame document = { 0, &defaultConsumers_ };
+    stack_.push_back(document);
   }
 
   void ExpatParserDispatcher::AddConsumer(const std::string& tagName, XMLConsumer* consumer) {
-    consumers_.insert(
-      std::upper_bound(consumers_.begin(), consumers_.end(), std::make_pair(tagName, (ExpatParserDispatcher::XMLConsumer*)nullptr), ComparePair),
-      std::make_pair(tagName, consumer)
-    );
+    int state = 0;
+    std::string::size_type begin = 0;
+
+    while (begin < tagName.size()) {
+      std::string::size_type end = tagName.find('/', begin);
+      if (end == std::string::npos) {
+        end = tagName.size();
+      }
+
+      if (end > begin) {
+        const int nameId = names_.Intern(tagName.substr(begin, end - begin));
+        int next = Transition(state, nameId);
+
+        if (next == NO_STATE) {
+          next = (int) states_.size();
+          states_.push_back(State());
+          transitions_[TransitionKey(state, nameId)] = next;
+        }
+
+        state = next;
+      }
+
+      begin = end + 1;
+    }
+
+    states_[state].consumers.push_back(consumer);
   }
 
   void ExpatParserDispatcher::SetDefaultConsumer(XMLConsumer* consumer) {
-    defaultConsumer_ = consumer;
+    defaultConsumers_.clear();
+
+    if (consumer) {
+      defaultConsumers_.push_back(consumer);
+    }
+  }
+
+  int ExpatParserDispatcher::Transition(int state, int nameId) const {
+    if (state == NO_STATE || nameId == NameTable::NOT_FOUND) {
+      return NO_STATE;
+    }
+
+    auto i = transitions_.find(TransitionKey(state, nameId));
+    return i != transitions_.end() ? i->second : NO_STATE;
   }
 
   void ExpatParserDispatcher::StartElement(const char *name, const char **atts) {
     currentNode_.name = name;
-    currentNode_.path += name + std::string("/");
+    currentNode_.path.append(name).push_back('/');
     currentNode_.depth++;
 
-    auto i = std::lower_bound(
-      consumers_.begin(), consumers_.end(),
-      std::make_pair(currentNode_.path, (ExpatParserDispatcher::XMLConsumer*)nullptr),
-      ComparePair
-    );
+    Frame frame;
+    frame.state = Transition(stack_.back().state, names_.Find(name));
+    frame.consumers = (frame.state != NO_STATE && !states_[frame.state].consumers.empty())
+      ? &states_[frame.state].consumers
+      : &defaultConsumers_;
 
-    auto end(consumers_.end());
-    if (i != end) {
-      for (; i != end && i->first == currentNode_.path; ++i) {
-        i->second->StartElement(currentNode_, atts);
-      }
+    stack_.push_back(frame);
+
+    // Trie states only exist for registered paths & their ancestors, so without a
+    // state (or a default consumer) nobody can be interested in this subtree
+    if (frame.state == NO_STATE && defaultConsumers_.empty()) {
+      SkipSubtree();
+      return;
     }
-    else if (defaultConsumer_) {
-      defaultConsumer_->StartElement(currentNode_, atts);
+
+    for (XMLConsumer* c : *frame.consumers) {
+      c->StartElement(currentNode_, atts);
     }
   }
 
   void ExpatParserDispatcher::EndElement(const char *name) {
     currentNode_.name = name;
 
-    auto i = std::lower_bound(
-      consumers_.begin(), consumers_.end(),
-      std::make_pair(currentNode_.path, (ExpatParserDispatcher::XMLConsumer*)nullptr),
-      ComparePair
-    );
-
-    auto end(consumers_.end());
-    if (i != end) {
-      for (; i != end && i->first == currentNode_.path; ++i) {
-        i->second->EndElement(currentNode_);
-      }
-    }
-    else if (defaultConsumer_) {
-      defaultConsumer_->EndElement(currentNode_);
+    for (XMLConsumer* c : *stack_.back().consumers) {
+      c->EndElement(currentNode_);
     }
 
+    stack_.pop_back();
     currentNode_.path.erase(currentNode_.path.length() - strlen(name) - 1);
     currentNode_.depth--;
   }
 
   void ExpatParserDispatcher::CharacterData(const XML_Char *s, int len) {
-    auto i = std::lower_bound(
-      consumers_.begin(), consumers_.end(),
-      std::make_pair(currentNode_.path, (ExpatParserDispatcher::XMLConsumer*)nullptr),
-      ComparePair
-    );
-
-    auto end(consumers_.end());
-    if (i != end) {
-      for (; i != end && i->first == currentNode_.path; ++i) {
-        i->second->CharacterData(currentNode_, s, len);
-      }
-    }
-    else if (defaultConsumer_) {
-      defaultConsumer_->CharacterData(currentNode_, s, len);
+    for (XMLConsumer* c : *stack_.back().consumers) {
+      c->CharacterData(currentNode_, s, len);
     }
   }
 
 
-} // james
\ No newline at end of file
+} // james
@@ -1,6 +1,9 @@
 #pragma once
 
 #include <james/expat-parser.hpp>
+#include <james/expat-name-table.hpp>
+#include <deque>
+#include <unordered_map>
 #include <vector>
 #include <utility>
 
@@ -26,8 +29,9 @@ namespace james {
       virtual void CharacterData(const NodeID& id, const XML_Char *s, int len) {}
     };
 
-    ExpatParserDispatcher() : defaultConsumer_(nullptr) {}
+    ExpatParserDispatcher();
 
+    // tagName is a path of element names, each followed by a '/' (i.e. "root/a/")
     void AddConsumer(const std::string& tagName, XMLConsumer* consumer);
     void SetDefaultConsumer(XMLConsumer* consumer);
 
@@ -36,9 +40,38 @@ namespace james {
     void CharacterData(const XML_Char *s, int len) override;
 
   private:
-    XMLConsumer* defaultConsumer_;
-    std::vector<std::pair<std::string, XMLConsumer*>> consumers_;
+    // Registered paths are compiled into a trie over interned element names. Parsing
+    // keeps a stack of trie states (one per open element) so each event is a single
+    // transition lookup or a pop rather than a search over path strings.
+    //
+    // Each stack frame also caches the consumers resolved for its element in
+    // StartElement (the default consumer if none matched), so CharacterData and
+    // EndElement dispatch straight from the top of the stack.
+    static const int NO_STATE = -1;
+
+    typedef std::vector<XMLConsumer*> ConsumerList;
+
+    struct State {
+      ConsumerList consumers;
+    };
+
+    struct Frame {
+      int state;
+      const ConsumerList* consumers;
+    };
+
+    ConsumerList defaultConsumers_;  // Empty, or just the default consumer
+    NameTable names_;
+    std::deque<State> states_;       // A deque so that Frame::consumers stays valid as states are added
+    std::unordered_map<unsigned long long, int> transitions_;  // (state, name id) -> state
+    std::vector<Frame> stack_;
     NodeID currentNode_;
+
+    int Transition(int state, int nameId) const;
+
+    static unsigned long long TransitionKey(int state, int nameId) {
+      return ((unsigned long long) (unsigned) state << 32) | (unsigned) nameId;
+    }
   };
 
-} // james
\ No newline at end of file
+} // james
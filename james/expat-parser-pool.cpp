@@ -0,0 +1,61 @@
+#include "expat-parser-pool.hpp"
+
+namespace james {
+
+  void ExpatParserPool::Releaser::operator ()(ExpatParser* parser) const {
+    if (pool) {
+      pool->Release(parser);
+    }
+    else {
+      delete parser;
+    }
+  }
+
+  ExpatParserPool::ExpatParserPool(RegisteredHandlers handlers, size_t maxIdle)
+    : handlers_(handlers), maxIdle_(maxIdle)
+  {
+  }
+
+  ExpatParserPool::Handle ExpatParserPool::Acquire(ExpatParser::XMLConsumer& consumer) {
+    std::unique_ptr<ExpatParser> parser;
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      if (!idle_.empty()) {
+        parser = std::move(idle_.back());
+        idle_.pop_back();
+      }
+    }
+
+    // Resetting (or creating) happens outside the lock: it is the expensive part and
+    // needs no shared state.
+    if (parser) {
+      parser->Reset(consumer);
+    }
+    else {
+      parser.reset(new ExpatParser(consumer, handlers_));
+    }
+
+    return Handle(parser.release(), Releaser(this));
+  }
+
+  size_t ExpatParserPool::IdleCount() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return idle_.size();
+  }
+
+  void ExpatParserPool::Release(ExpatParser* parser) {
+    std::unique_ptr<ExpatParser> p(parser);
+
+    // The consumer usually dies right after its Handle; an idle parser mustn't keep it
+    p->Unbind();
+
+    std::lock_guard<std::mutex> lock(mutex_);
+
+    if (idle_.size() < maxIdle_) {
+      idle_.push_back(std::move(p));
+    }
+  }
+
+} // james
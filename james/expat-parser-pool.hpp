@@ -0,0 +1,51 @@
+#pragma once
+
+#include <james/expat-parser.hpp>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace james {
+
+  //
+  // Thread-safe pool of ExpatParsers.
+  //
+  // Acquire() hands out a parser which has been Reset() and bound to the given consumer;
+  // the parser is unbound from it and goes back into the pool when the returned Handle is
+  // destroyed, so the consumer need only outlive the Handle. Reusing
+  // parsers keeps Expat's internal buffers & hash tables alive between documents.
+  //
+  // The pool must outlive every Handle it gives out.
+  //
+  struct ExpatParserPool {
+    struct Releaser {
+      ExpatParserPool* pool;
+
+      Releaser() : pool(nullptr) {}
+      explicit Releaser(ExpatParserPool* pool) : pool(pool) {}
+
+      void operator ()(ExpatParser* parser) const;
+    };
+
+    typedef std::unique_ptr<ExpatParser, Releaser> Handle;
+
+    explicit ExpatParserPool(RegisteredHandlers handlers = DEFAULT_HANDLERS_ONLY, size_t maxIdle = 64);
+
+    ExpatParserPool(const ExpatParserPool&) = delete;
+    ExpatParserPool& operator =(const ExpatParserPool&) = delete;
+
+    Handle Acquire(ExpatParser::XMLConsumer&);
+
+    size_t IdleCount() const;
+
+  private:
+    RegisteredHandlers handlers_;
+    size_t maxIdle_;
+
+    mutable std::mutex mutex_;
+    std::vector<std::unique_ptr<ExpatParser>> idle_;
+
+    void Release(ExpatParser*);
+  };
+
+} // james
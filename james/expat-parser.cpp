@@ -1,73 +1,275 @@
 #include "expat-parser.hpp"
-
+#include "expat-arena.hpp"
+#include "expat-util.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include <condition_variable>
+#include <fstream>
+#include <mutex>
+#include <thread>
 #include <vector>
 #include <assert.h>
 
 namespace james {
 
+  // Points the consumer at this parser for one Parse()/ParseBuffer()/Resume() call, so
+  // its SkipSubtree() & StopParser() work from callbacks. Restoring the old pointer on
+  // the way out means the consumer never holds on to a parser between calls, and the
+  // parser never needs to touch a consumer it may have outlived.
+  struct ExpatParser::ConsumerBinding {
+    XMLConsumer* consumer;
+    ExpatParser* previous;
+
+    explicit ConsumerBinding(ExpatParser& parser)
+      : consumer(parser.consumer_), previous(nullptr)
+    {
+      assert(consumer && "ExpatParser used after Unbind() without Reset(XMLConsumer&)");
+      previous = consumer->parser_;
+      consumer->parser_ = &parser;
+    }
+
+    ~ConsumerBinding() { consumer->parser_ = previous; }
+
+    ConsumerBinding(const ConsumerBinding&) = delete;
+    ConsumerBinding& operator =(const ConsumerBinding&) = delete;
+  };
+
   ExpatParser::ExpatParser(XMLConsumer& consumer, RegisteredHandlers handlers)
-    : consumer_(consumer), parser_(XML_ParserCreate(nullptr)), done_(false)
+    : consumer_(&consumer), parser_(XML_ParserCreate(nullptr)), handlers_(handlers), done_(false), stopped_(false), skipDepth_(0)
   {
     if (!parser_) {
       throw std::runtime_error("Unable to create Expat parser (XML_ParserCreate failed)");
     }
 
+    InstallHandlers();
+  }
+
+  ExpatParser::ExpatParser(XMLConsumer& consumer, const ArenaOptions& options, RegisteredHandlers handlers)
+    : consumer_(&consumer), arena_(new ExpatArena(options.chunkSize, options.maxBytes)),
+      parser_(nullptr), handlers_(handlers), done_(false), stopped_(false), skipDepth_(0)
+  {
+    ExpatArena::Scope scope(arena_.get());
+
+    parser_ = XML_ParserCreate_MM(nullptr, &ExpatArena::MemorySuite, nullptr);
+
+    if (!parser_) {
+      throw std::runtime_error("Unable to create Expat parser (XML_ParserCreate_MM failed)");
+    }
+
+    InstallHandlers();
+  }
+
+  ExpatParser::~ExpatParser() {
+    if (parser_) {
+      XML_ParserFree(parser_);
+    }
+  }
+
+  void ExpatParser::Reset() {
+    if (arena_) {
+      // Rather than have Expat return its blocks one at a time, drop the whole parser,
+      // rewind the arena and build a new parser in the recycled memory.
+      XML_ParserFree(parser_);
+      parser_ = nullptr;
+
+      arena_->Release();
+
+      ExpatArena::Scope scope(arena_.get());
+      parser_ = XML_ParserCreate_MM(nullptr, &ExpatArena::MemorySuite, nullptr);
+
+      if (!parser_) {
+        throw std::runtime_error("Unable to reset Expat parser (XML_ParserCreate_MM failed)");
+      }
+    }
+    // XML_ParserReset clears the user data & every handler so they need installing again
+    else if (!XML_ParserReset(parser_, nullptr)) {
+      throw std::runtime_error("Unable to reset Expat parser (XML_ParserReset failed)");
+    }
+
+    InstallHandlers();
+
+    done_ = false;
+    stopped_ = false;
+    skipDepth_ = 0;
+    currentException_ = nullptr;
+  }
+
+  void ExpatParser::Reset(XMLConsumer& consumer) {
+    consumer_ = &consumer;
+    Reset();
+  }
+
+  void ExpatParser::Unbind() {
+    consumer_ = nullptr;
+  }
+
+  void ExpatParser::SkipSubtree() {
+    skipDepth_ = 1;
+
+    ClearHandlers();
+    XML_SetElementHandler(parser_, SkippedStartElement, SkippedEndElement);
+  }
+
+  void ExpatParser::Stop() {
+    if (stopped_) {
+      return;
+    }
+
+    stopped_ = true;
+    done_ = true;
+
+    // Expat may still deliver a few events after XML_StopParser so unregister
+    // everything rather than checking stopped_ in every callback
+    ClearHandlers();
+    XML_SetElementHandler(parser_, nullptr, nullptr);
+
+    XML_StopParser(parser_, XML_FALSE);
+  }
+
+  void ExpatParser::Suspend() {
+    if (!Suspended()) {
+      XML_StopParser(parser_, XML_TRUE);
+    }
+  }
+
+  void ExpatParser::Resume() {
+    assert(Suspended());
+
+    currentException_ = nullptr;
+
+    ExpatArena::Scope scope(arena_.get());
+    ConsumerBinding binding(*this);
+
+    if (XML_ResumeParser(parser_) == XML_STATUS_ERROR) {
+      HandleParseError();
+    }
+  }
+
+  bool ExpatParser::Suspended() const {
+    XML_ParsingStatus status;
+    XML_GetParsingStatus(parser_, &status);
+    return status.parsing == XML_SUSPENDED;
+  }
+
+  void ExpatParser::XMLConsumer::SkipSubtree() {
+    if (parser_) {
+      parser_->SkipSubtree();
+    }
+  }
+
+  void ExpatParser::XMLConsumer::StopParser() {
+    if (parser_) {
+      parser_->Stop();
+    }
+  }
+
+  void ExpatParser::ClearHandlers() {
+    // XML_SetDefaultHandler would also turn off internal entity expansion for the
+    // rest of the document, even when passed nullptr
+    XML_SetCharacterDataHandler(parser_, nullptr);
+    XML_SetDefaultHandlerExpand(parser_, nullptr);
+    XML_SetProcessingInstructionHandler(parser_, nullptr);
+    XML_SetCommentHandler(parser_, nullptr);
+    XML_SetCdataSectionHandler(parser_, nullptr, nullptr);
+  }
+
+  void ExpatParser::InstallHandlers() {
     XML_SetUserData(parser_, this);
     XML_SetElementHandler(parser_, StartElement, EndElement);
     XML_SetCharacterDataHandler(parser_, CharacterDataHandler);
 
-    if (handlers & DEFAULT_HANDLER) {
+    if (handlers_ & DEFAULT_HANDLER) {
       XML_SetDefaultHandler(parser_, DefaultHandler);
     }
 
-    if (handlers & PI_HANDLER) {
+    if (handlers_ & PI_HANDLER) {
       XML_SetProcessingInstructionHandler(parser_, ProcessingInstruction);
     }
 
-    if (handlers & COMMENT_HANDLER) {
+    if (handlers_ & COMMENT_HANDLER) {
       XML_SetCommentHandler(parser_, Comment);
     }
 
-    if (handlers & CDATA_HANDLER) {
+    if (handlers_ & CDATA_HANDLER) {
       XML_SetCdataSectionHandler(parser_, StartCData, EndCData);
     }
   }
 
-  ExpatParser::~ExpatParser() {
-    XML_ParserFree(parser_);
-  }
-
   void ExpatParser::Parse(const char* data, size_t length, bool done) {
     assert(!done_);
 
     done_ = done;
     currentException_ = nullptr;
 
+    ExpatArena::Scope scope(arena_.get());
+    ConsumerBinding binding(*this);
+
     if (XML_Parse(parser_, data, length, done) == XML_STATUS_ERROR) {
-      // Two distinct reasons for XML_STATUS_ERROR are possible & require different action:
-      // (1) A user callback threw an exception - in which case the exception will have been stored
-      //     in currentException_ and simply needs to be rethrow.
-      // (2) An Expat error occured, probably because of duff XML data but could be anything.
-      //     In this case we throw an ExpatParser::Exception 
-
-      if (currentException_) {
-        std::rethrow_exception(currentException_);
-      }
-      else {
-        throw Exception(
-          XML_ErrorString(XML_GetErrorCode(parser_)),
-          XML_GetErrorCode(parser_),
-          XML_GetCurrentLineNumber(parser_)
-        );
-      }
+      HandleParseError();
     }
-
   }
 
   void ExpatParser::Parse(const std::string& xml, bool done) {
     Parse(xml.c_str(), xml.size(), done);
   }
 
+  void* ExpatParser::GetBuffer(size_t length) {
+    assert(!done_);
+
+    ExpatArena::Scope scope(arena_.get());
+    void* buffer = XML_GetBuffer(parser_, (int) length);
+
+    if (!buffer) {
+      throw Exception(
+        XML_ErrorString(XML_GetErrorCode(parser_)),
+        XML_GetErrorCode(parser_),
+        XML_GetCurrentLineNumber(parser_)
+      );
+    }
+
+    return buffer;
+  }
+
+  void ExpatParser::ParseBuffer(size_t length, bool done) {
+    assert(!done_);
+
+    done_ = done;
+    currentException_ = nullptr;
+
+    ExpatArena::Scope scope(arena_.get());
+    ConsumerBinding binding(*this);
+
+    if (XML_ParseBuffer(parser_, (int) length, done) == XML_STATUS_ERROR) {
+      HandleParseError();
+    }
+  }
+
+  void ExpatParser::HandleParseError() {
+    // Three distinct reasons for XML_STATUS_ERROR are possible & require different action:
+    // (1) A user callback threw an exception - in which case the exception will have been stored
+    //     in currentException_ and simply needs to be rethrow.
+    // (2) Stop() was called - which isn't an error at all.
+    // (3) An Expat error occured, probably because of duff XML data but could be anything.
+    //     In this case we throw an ExpatParser::Exception 
+
+    if (currentException_) {
+      std::rethrow_exception(currentException_);
+    }
+    else if (stopped_ && XML_GetErrorCode(parser_) == XML_ERROR_ABORTED) {
+      return;
+    }
+    else {
+      throw Exception(
+        XML_ErrorString(XML_GetErrorCode(parser_)),
+        XML_GetErrorCode(parser_),
+        XML_GetCurrentLineNumber(parser_)
+      );
+    }
+  }
+
   void ExpatParser::StartElement(void *userData, const char *name, const char **atts) {
     // Note on commenting:
     //
@@ -87,7 +289,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.StartElement(name, atts);
+      parser->consumer_->StartElement(name, atts);
     }
     catch (...) {
       // Basic idea: if an exception is thrown:
@@ -106,7 +308,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.EndElement(name);
+      parser->consumer_->EndElement(name);
     }
     catch (...) {
       XML_StopParser(parser->parser_, XML_FALSE);
@@ -122,7 +324,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.CharacterData(s, len);
+      parser->consumer_->CharacterData(s, len);
     }
     catch (...) {
       XML_StopParser(parser->parser_, XML_FALSE);
@@ -138,7 +340,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.DefaultHandler(s, len);
+      parser->consumer_->DefaultHandler(s, len);
     }
     catch (...) {
       XML_StopParser(parser->parser_, XML_FALSE);
@@ -154,7 +356,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.ProcessingInstruction(target, data);
+      parser->consumer_->ProcessingInstruction(target, data);
     }
     catch (...) {
       XML_StopParser(parser->parser_, XML_FALSE);
@@ -170,7 +372,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.Comment(data);
+      parser->consumer_->Comment(data);
     }
     catch (...) {
       XML_StopParser(parser->parser_, XML_FALSE);
@@ -186,7 +388,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.StartCData();
+      parser->consumer_->StartCData();
     }
     catch (...) {
       XML_StopParser(parser->parser_, XML_FALSE);
@@ -202,7 +404,7 @@ namespace james {
     }
 
     try {
-      parser->consumer_.EndCData();
+      parser->consumer_->EndCData();
     }
     catch (...) {
       XML_StopParser(parser->parser_, XML_FALSE);
@@ -210,6 +412,21 @@ namespace james {
     }
   }
 
+  void ExpatParser::SkippedStartElement(void *userData, const char *name, const char **atts) {
+    ((ExpatParser*)userData)->skipDepth_++;
+  }
+
+  void ExpatParser::SkippedEndElement(void *userData, const char *name) {
+    ExpatParser* parser = (ExpatParser*)userData;
+
+    // When the skipped element itself closes put the real handlers back & let the
+    // consumer see its EndElement
+    if (--parser->skipDepth_ == 0) {
+      parser->InstallHandlers();
+      EndElement(userData, name);
+    }
+  }
+
   //
   // **************************************
   // Non-member utility functions
@@ -228,27 +445,50 @@ namespace james {
     return defaultVal;
   }
 
-  void ParseStream(ExpatParser& parser, std::istream& src, size_t bufferSize) {
-    std::vector<char> buffer(bufferSize, 0);
+  namespace {
+    // ParseStream stops growing its read size once a single chunk takes longer than
+    // this to parse: beyond that the per-call overhead being amortised is negligible
+    // and larger chunks only add memory & latency.
+    const std::chrono::milliseconds MAX_CHUNK_PARSE_TIME(5);
+  }
+
+  void ParseStream(ExpatParser& parser, std::istream& src, size_t bufferSize, size_t maxBufferSize, ParseStreamStats* stats) {
+    ParseStreamStats localStats;
+    ParseStreamStats& s = stats ? *stats : localStats;
     std::streamsize bytesRead;
+    bool done;
+
+    bufferSize = std::max(bufferSize, (size_t) 1);
+    maxBufferSize = std::min(std::max(maxBufferSize, bufferSize), (size_t) INT_MAX);
+    s = ParseStreamStats();
 
     std::ios::iostate exceptionState(src.exceptions());
     src.exceptions(exceptionState & ~std::ios::eofbit);
 
     try {
-      while (true) {
-        src.read(&buffer[0], buffer.size());
+      // Read straight into Expat's own buffer so that each byte is only copied once
+      // (XML_Parse would otherwise copy our buffer into Expat's internal one).
+      do {
+        char* buffer = static_cast<char*>(parser.GetBuffer(bufferSize));
+
+        src.read(buffer, bufferSize);
         bytesRead = src.gcount();
+        done = src.eof();
 
-        if (bytesRead > 0) {
-          parser.Parse(&buffer[0], (size_t) bytesRead, XML_FALSE);
-        }
-        if (src.eof()) {
-          break;
-        }
-      }
+        s.bufferSize = bufferSize;
+        s.bytesRead += (size_t) bytesRead;
+        s.reads++;
+
+        auto start(std::chrono::steady_clock::now());
+        parser.ParseBuffer((size_t) bytesRead, done);
+        auto elapsed(std::chrono::steady_clock::now() - start);
 
-      parser.Parse(&buffer[0], 0, XML_TRUE);
+        // Grow only when the source filled the whole buffer (so more data is probably
+        // waiting) and the parser is still turning chunks around quickly.
+        if ((size_t) bytesRead == bufferSize && bufferSize < maxBufferSize && elapsed < MAX_CHUNK_PARSE_TIME) {
+          bufferSize = std::min(bufferSize * 2, maxBufferSize);
+        }
+      } while (!done && !parser.Stopped());
     }
     catch (...) {
       src.clear(src.rdstate() & ~std::ios::eofbit);
@@ -259,4 +499,185 @@ namespace james {
     src.clear(src.rdstate() & ~std::ios::eofbit);
     src.exceptions(exceptionState);
   }
+
+  namespace {
+    // One slot in ParseStreamPipelined's ring. A slot belongs to the reader thread
+    // while full is false & to the parsing thread while it's true.
+    struct PipelineBuffer {
+      std::vector<char> data;
+      size_t length;
+      bool last;
+      bool full;
+      std::exception_ptr error;  // From reading src
+
+      PipelineBuffer() : length(0), last(false), full(false) {}
+    };
+  }
+
+  void ParseStreamPipelined(ExpatParser& parser, std::istream& src, size_t bufferSize, size_t bufferCount) {
+    bufferSize = std::min(std::max(bufferSize, (size_t) 1), (size_t) INT_MAX);
+    bufferCount = std::max(bufferCount, (size_t) 2);
+
+    std::vector<PipelineBuffer> ring(bufferCount);
+    for (auto& b : ring) {
+      b.data.resize(bufferSize);
+    }
+
+    std::mutex mutex;
+    std::condition_variable filled;
+    std::condition_variable emptied;
+    bool cancelled = false;
+
+    std::ios::iostate exceptionState(src.exceptions());
+    src.exceptions(exceptionState & ~std::ios::eofbit);
+
+    std::thread reader([&]() {
+      for (size_t i = 0; ; i = (i + 1) % bufferCount) {
+        PipelineBuffer& b = ring[i];
+
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          emptied.wait(lock, [&]() { return cancelled || !b.full; });
+
+          if (cancelled) {
+            return;
+          }
+        }
+
+        size_t length = 0;
+        bool last;
+        std::exception_ptr error;
+
+        try {
+          src.read(b.data.data(), bufferSize);
+          length = (size_t) src.gcount();
+          last = src.eof();
+        }
+        catch (...) {
+          error = std::current_exception();
+          last = true;
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          b.length = length;
+          b.last = last;
+          b.error = error;
+          b.full = true;
+        }
+
+        filled.notify_one();
+
+        if (last) {
+          return;
+        }
+      }
+    });
+
+    // Waits for a read in progress to finish, so the stream can be handed back
+    auto stopReader = [&]() {
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        cancelled = true;
+      }
+      emptied.notify_one();
+      reader.join();
+
+      src.clear(src.rdstate() & ~std::ios::eofbit);
+      src.exceptions(exceptionState);
+    };
+
+    try {
+      for (size_t i = 0; ; i = (i + 1) % bufferCount) {
+        PipelineBuffer& b = ring[i];
+
+        {
+          std::unique_lock<std::mutex> lock(mutex);
+          filled.wait(lock, [&]() { return b.full; });
+        }
+
+        if (b.error) {
+          std::rethrow_exception(b.error);
+        }
+
+        parser.Parse(b.data.data(), b.length, b.last);
+
+        if (b.last || parser.Stopped()) {
+          break;
+        }
+
+        {
+          std::lock_guard<std::mutex> lock(mutex);
+          b.full = false;
+        }
+
+        emptied.notify_one();
+      }
+    }
+    catch (...) {
+      stopReader();
+      throw;
+    }
+
+    stopReader();
+  }
+
+  #ifdef JAMES_HAVE_MMAP
+
+  void ParseFile(ExpatParser& parser, const std::string& path, size_t windowSize) {
+    detail::FileDescriptor file(open(path.c_str(), O_RDONLY));
+
+    if (file.fd < 0) {
+      throw std::runtime_error("Unable to open " + path + " (open failed)");
+    }
+
+    struct stat info;
+    if (fstat(file.fd, &info) != 0) {
+      throw std::runtime_error("Unable to read the size of " + path + " (fstat failed)");
+    }
+
+    // Windows must start on a page boundary & Expat takes lengths as an int, so round
+    // the requested size to whole pages & keep it within INT_MAX.
+    const size_t pageSize = (size_t) sysconf(_SC_PAGESIZE);
+    windowSize = std::min(windowSize, (size_t) INT_MAX);
+    windowSize = std::max(pageSize, windowSize - windowSize % pageSize);
+
+    const off_t fileSize = info.st_size;
+
+    if (fileSize == 0) {
+      parser.Parse("", 0, true);
+      return;
+    }
+
+    for (off_t offset = 0; offset < fileSize; offset += windowSize) {
+      const size_t length = (size_t) std::min((off_t) windowSize, fileSize - offset);
+      detail::MappedWindow window(file.fd, offset, length);
+
+      if (window.data == MAP_FAILED) {
+        throw std::runtime_error("Unable to map " + path + " (mmap failed)");
+      }
+
+      madvise(window.data, length, MADV_SEQUENTIAL);
+
+      parser.Parse(static_cast<const char*>(window.data), length, offset + (off_t) length >= fileSize);
+
+      if (parser.Stopped()) {
+        break;
+      }
+    }
+  }
+
+  #else
+
+  void ParseFile(ExpatParser& parser, const std::string& path, size_t windowSize) {
+    std::ifstream src(path, std::ios::in | std::ios::binary);
+
+    if (!src) {
+      throw std::runtime_error("Unable to open " + path);
+    }
+
+    ParseStream(parser, src, windowSize, windowSize);
+  }
+
+  #endif
 }
@@ -1,8 +1,10 @@
 #pragma once
 
 #include <expat.h>
+#include <memory>
 #include <stdexcept>
 #include <istream>
+#include <string>
 
 namespace james {
 
@@ -15,6 +17,8 @@ namespace james {
     DEFAULT_HANDLERS_ONLY = 0
   };
 
+  struct ExpatArena;
+
   struct ExpatParser {
     struct Exception
       : std::runtime_error
@@ -34,6 +38,7 @@ namespace james {
     };
 
     struct XMLConsumer {
+      XMLConsumer() : parser_(nullptr) {}
       virtual ~XMLConsumer() {}
 
       virtual void StartElement(const char *name, const char **atts) {}
@@ -46,9 +51,33 @@ namespace james {
       virtual void Comment(const XML_Char *data) {}
       virtual void StartCData() {}
       virtual void EndCData() {}
+
+    protected:
+      // Call SkipSubtree()/Stop() on the ExpatParser delivering events to this consumer.
+      // Outside a Parse()/ParseBuffer()/Resume() call they do nothing.
+      void SkipSubtree();
+      void StopParser();
+
+    private:
+      friend struct ExpatParser;
+      ExpatParser* parser_;
+    };
+
+    // Selects an arena (bump) allocator for all of Expat's memory. The whole arena is
+    // released in one go by Reset(), rather than block by block. maxBytes caps the
+    // memory used per document (0 for no limit); exceeding it fails the parse with
+    // XML_ERROR_NO_MEMORY.
+    struct ArenaOptions {
+      size_t maxBytes;
+      size_t chunkSize;
+
+      explicit ArenaOptions(size_t maxBytes = 0, size_t chunkSize = 64 * 1024)
+        : maxBytes(maxBytes), chunkSize(chunkSize)
+      {}
     };
 
     ExpatParser(XMLConsumer&, RegisteredHandlers handlers = DEFAULT_HANDLERS_ONLY);
+    ExpatParser(XMLConsumer&, const ArenaOptions&, RegisteredHandlers handlers = DEFAULT_HANDLERS_ONLY);
     ~ExpatParser();
 
     ExpatParser(const ExpatParser&) = delete;
@@ -57,12 +86,61 @@ namespace james {
     void Parse(const char* data, size_t length, bool done);
     void Parse(const std::string&, bool done = true);
 
+    // Zero-copy alternative to Parse(): fill the buffer returned by GetBuffer()
+    // and then pass the number of bytes actually written to ParseBuffer().
+    // The buffer is owned by Expat and is only valid until the next call to
+    // GetBuffer(), ParseBuffer() or Parse().
+    void* GetBuffer(size_t length);
+    void ParseBuffer(size_t length, bool done);
+
+    // Prepares the parser for a new document (via XML_ParserReset) while keeping
+    // Expat's internal buffers & tables, which is much cheaper than creating a new
+    // ExpatParser. The second form also switches to a different consumer.
+    void Reset();
+    void Reset(XMLConsumer&);
+
+    // Forgets the consumer, e.g. before it is destroyed while the parser lives on (as
+    // pooled parsers do). The parser never touches a consumer outside Parse(),
+    // ParseBuffer() & Resume() anyway; this makes sure it cannot until Reset(XMLConsumer&).
+    void Unbind();
+
+    // Skips the rest of the current element: nothing inside it reaches the consumer
+    // and the next event delivered is the element's EndElement. While skipping, Expat
+    // only calls back to count nesting depth (character data & the optional handlers
+    // are unregistered). Intended to be called from the consumer's StartElement.
+    void SkipSubtree();
+
+    // Ends parsing early, e.g. once a consumer has everything it needs. No further
+    // events reach the consumer, the Parse()/ParseBuffer() call in progress returns
+    // normally and Stopped() becomes true. ParseStream & ParseFile stop reading input.
+    void Stop();
+    bool Stopped() const { return stopped_; }
+
+    // Pauses parsing after the current event (via XML_StopParser(parser, XML_TRUE)):
+    // the Parse()/ParseBuffer()/Resume() call in progress returns with Suspended()
+    // true and Resume() carries on from where it left off. The names & attributes
+    // passed to the last callbacks stay valid until then. Only ParseBuffer() input
+    // may be suspended - Parse() doesn't keep a copy of the caller's data.
+    void Suspend();
+    void Resume();
+    bool Suspended() const;
+
   private:
-    XMLConsumer& consumer_;
+    XMLConsumer* consumer_;
+    std::unique_ptr<ExpatArena> arena_;
     XML_Parser parser_;
+    RegisteredHandlers handlers_;
     bool done_;
+    bool stopped_;
+    int skipDepth_;
     std::exception_ptr currentException_;
 
+    void InstallHandlers();
+    void ClearHandlers();
+
+    struct ConsumerBinding;
+    void HandleParseError();
+
     static void XMLCALL StartElement(void *userData, const char *name, const char **atts);
     static void XMLCALL EndElement(void *userData, const char *name);
     static void XMLCALL CharacterDataHandler(void *userData, const XML_Char *s, int len);
@@ -72,6 +150,9 @@ namespace james {
     static void XMLCALL Comment(void *userData, const XML_Char *data);
     static void XMLCALL StartCData(void *userData);
     static void XMLCALL EndCData(void *userData);
+
+    static void XMLCALL SkippedStartElement(void *userData, const char *name, const char **atts);
+    static void XMLCALL SkippedEndElement(void *userData, const char *name);
   };
 
   //
@@ -82,5 +163,35 @@ namespace james {
 
   const char* FindAttribute(const char** atts, const char* name, const char* defaultVal = nullptr);
 
-  void ParseStream(ExpatParser& parser, std::istream&, size_t bufferSize = 1024);
+  struct ParseStreamStats {
+    size_t bufferSize;  // Read size in use when the stream ended
+    size_t bytesRead;
+    size_t reads;
+
+    ParseStreamStats() : bufferSize(0), bytesRead(0), reads(0) {}
+  };
+
+  // Reads src in chunks of bufferSize bytes to begin with. While the stream keeps
+  // filling whole chunks and each chunk parses quickly the read size is doubled, up
+  // to maxBufferSize. Pass maxBufferSize == bufferSize for a fixed read size.
+  void ParseStream(
+    ExpatParser& parser, std::istream&,
+    size_t bufferSize = 4096, size_t maxBufferSize = 1024 * 1024,
+    ParseStreamStats* stats = nullptr
+  );
+
+  // As ParseStream, but src is read on a separate thread into a ring of bufferCount
+  // buffers (of bufferSize bytes each), so reading the next chunk overlaps parsing the
+  // current one. Worthwhile when reads block - network filesystems, decompressing
+  // streams & the like. src must not be used by anything else until this returns.
+  void ParseStreamPipelined(
+    ExpatParser& parser, std::istream&,
+    size_t bufferSize = 64 * 1024, size_t bufferCount = 3
+  );
+
+  // Parses the file at path. On POSIX systems the file is memory mapped and fed to
+  // the parser one window (of roughly windowSize bytes, rounded to whole pages) at a
+  // time, unmapping each window once it has been consumed. Elsewhere this falls back
+  // to ParseStream using windowSize as the buffer size.
+  void ParseFile(ExpatParser& parser, const std::string& path, size_t windowSize = 16 * 1024 * 1024);
 }
\ No newline at end of file
@@ -0,0 +1,98 @@
+#include "expat-reader.hpp"
+
+namespace james {
+
+  ExpatReader::ExpatReader(std::istream& src, size_t bufferSize)
+    : src_(src), exceptionState_(src.exceptions()), bufferSize_(bufferSize),
+      parser_(*this), inputDone_(false), finished_(false), depth_(0), nextPending_(0)
+  {
+    // As for ParseStream: reaching the end of the stream is expected
+    src_.exceptions(exceptionState_ & ~std::ios::eofbit);
+  }
+
+  ExpatReader::~ExpatReader() {
+    src_.clear(src_.rdstate() & ~std::ios::eofbit);
+    src_.exceptions(exceptionState_);
+  }
+
+  const ExpatReader::Event& ExpatReader::Next() {
+    if (nextPending_ == pending_.size()) {
+      // Everything handed out so far is now finished with
+      pending_.clear();
+      nextPending_ = 0;
+      text_.clear();
+
+      while (pending_.empty() && !finished_) {
+        Advance();
+      }
+    }
+
+    if (nextPending_ < pending_.size()) {
+      current_ = pending_[nextPending_++];
+    }
+    else {
+      current_ = Event();
+    }
+
+    return current_;
+  }
+
+  void ExpatReader::Advance() {
+    if (parser_.Suspended()) {
+      parser_.Resume();
+    }
+    else {
+      char* buffer = static_cast<char*>(parser_.GetBuffer(bufferSize_));
+
+      src_.read(buffer, bufferSize_);
+      inputDone_ = src_.eof();
+
+      parser_.ParseBuffer((size_t) src_.gcount(), inputDone_);
+    }
+
+    if (!parser_.Suspended() && inputDone_) {
+      finished_ = true;
+    }
+  }
+
+  void ExpatReader::Push(Event& e) {
+    // Any text gathered since the last tag belongs before it (text can't arrive
+    // between the start & end of an empty element so only the first tag of a batch
+    // can have any)
+    if (!text_.empty() && pending_.empty()) {
+      Event text;
+      text.type = TEXT;
+      text.text = StringView(text_);
+      text.depth = e.type == START_ELEMENT ? e.depth - 1 : e.depth;
+      pending_.push_back(text);
+    }
+
+    pending_.push_back(e);
+    parser_.Suspend();
+  }
+
+  void ExpatReader::StartElement(const char *name, const char **atts) {
+    Event e;
+    e.type = START_ELEMENT;
+    e.name = name;
+    e.atts = atts;
+    e.depth = ++depth_;
+
+    Push(e);
+  }
+
+  void ExpatReader::EndElement(const char *name) {
+    Event e;
+    e.type = END_ELEMENT;
+    e.name = name;
+    e.depth = depth_--;
+
+    Push(e);
+  }
+
+  void ExpatReader::CharacterData(const XML_Char *s, int len) {
+    // Copied because Expat may pass text from its own temporaries
+    text_.append(s, len);
+  }
+
+} // james
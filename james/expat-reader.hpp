@@ -0,0 +1,81 @@
+#pragma once
+
+#include <james/expat-parser.hpp>
+#include <james/expat-string-view.hpp>
+#include <istream>
+#include <string>
+#include <vector>
+
+namespace james {
+
+  //
+  // Pull style reader: rather than the parser calling an XMLConsumer, the caller asks
+  // for one event at a time with Next().
+  //
+  //   ExpatReader reader(src);
+  //   for (auto* e = &reader.Next(); e->type != ExpatReader::END_DOCUMENT; e = &reader.Next()) {
+  //     ...
+  //   }
+  //
+  // The underlying ExpatParser is suspended after every start & end tag and only
+  // resumed by a later Next(), so input is read a buffer at a time as needed and the
+  // names, attributes & text in an Event remain valid until the next call to Next().
+  //
+  // Text is reported as a single event per run (i.e. between two tags).
+  //
+  struct ExpatReader
+    : private ExpatParser::XMLConsumer
+  {
+    enum EventType {
+      START_ELEMENT,
+      END_ELEMENT,
+      TEXT,
+      END_DOCUMENT
+    };
+
+    struct Event {
+      EventType type;
+      const char* name;    // START_ELEMENT & END_ELEMENT
+      const char** atts;   // START_ELEMENT only; name/value pairs as for XMLConsumer
+      StringView text;     // TEXT only
+      int depth;
+
+      Event() : type(END_DOCUMENT), name(nullptr), atts(nullptr), depth(0) {}
+    };
+
+    explicit ExpatReader(std::istream& src, size_t bufferSize = 64 * 1024);
+    ~ExpatReader();
+
+    ExpatReader(const ExpatReader&) = delete;
+    ExpatReader& operator =(const ExpatReader&) = delete;
+
+    // Throws ExpatParser::Exception on malformed XML, as ExpatParser::Parse does
+    const Event& Next();
+
+  private:
+    std::istream& src_;
+    std::ios::iostate exceptionState_;
+    size_t bufferSize_;
+
+    ExpatParser parser_;
+    bool inputDone_;
+    bool finished_;
+    int depth_;
+
+    // Events produced by the last stretch of parsing. Usually just one, but a run of
+    // text comes out with the tag that ends it & an empty element (<a/>) produces
+    // both its start & end before Expat gets the chance to suspend.
+    std::vector<Event> pending_;
+    size_t nextPending_;
+    std::string text_;
+    Event current_;
+
+    void Advance();
+    void Push(Event&);
+
+    void StartElement(const char *name, const char **atts) override;
+    void EndElement(const char *name) override;
+    void CharacterData(const XML_Char *s, int len) override;
+  };
+
+} // james
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstring>
+#include <ostream>
+#include <string>
+
+namespace james {
+
+  //
+  // Non-owning view of a run of characters: a minimal stand-in for C++17's
+  // std::string_view (which VS2015 doesn't have).
+  //
+  // Views handed to callbacks point into the wrapper's or Expat's buffers & are only
+  // valid until the callback returns; copy them into a std::string to keep them.
+  //
+  struct StringView {
+    StringView() : data_(""), size_(0) {}
+    StringView(const char* data, std::size_t size) : data_(data), size_(size) {}
+    StringView(const char* s) : data_(s), size_(strlen(s)) {}
+    StringView(const std::string& s) : data_(s.data()), size_(s.size()) {}
+
+    const char* data() const { return data_; }
+    std::size_t size() const { return size_; }
+    std::size_t length() const { return size_; }
+    bool empty() const { return size_ == 0; }
+
+    const char* begin() const { return data_; }
+    const char* end() const { return data_ + size_; }
+
+    char operator[](std::size_t i) const { return data_[i]; }
+
+    std::string str() const { return std::string(data_, size_); }
+    operator std::string() const { return str(); }
+
+    friend bool operator ==(StringView a, StringView b) {
+      return a.size_ == b.size_ && memcmp(a.data_, b.data_, a.size_) == 0;
+    }
+
+    friend bool operator !=(StringView a, StringView b) {
+      return !(a == b);
+    }
+
+    friend std::ostream& operator <<(std::ostream& os, StringView s) {
+      return os.write(s.data_, (std::streamsize) s.size_);
+    }
+
+  private:
+    const char* data_;
+    std::size_t size_;
+  };
+
+} // james
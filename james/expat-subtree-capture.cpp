@@ -0,0 +1,146 @@
+#include "expat-subtree-capture.hpp"
+
+#include <cstring>
+
+namespace james {
+
+  const std::uint32_t CapturedTree::NO_NODE;
+
+  const CapturedTree::Node* CapturedTree::Child(const Node& n, const char* name) const {
+    const int id = names_->Find(name);
+
+    if (id == NameTable::NOT_FOUND) {
+      return nullptr;
+    }
+
+    for (const Node* c = FirstChild(n); c; c = NextSibling(*c)) {
+      if (c->name == (std::uint32_t) id) {
+        return c;
+      }
+    }
+
+    return nullptr;
+  }
+
+  const CapturedTree::Attribute* CapturedTree::FindAttribute(const Node& n, const char* name) const {
+    const int id = names_->Find(name);
+
+    if (id == NameTable::NOT_FOUND) {
+      return nullptr;
+    }
+
+    for (const Attribute* a = AttributesBegin(n); a != AttributesEnd(n); ++a) {
+      if (a->name == (std::uint32_t) id) {
+        return a;
+      }
+    }
+
+    return nullptr;
+  }
+
+  SubtreeCapture::SubtreeCapture(TreeFunc onTree)
+    : onTree_(onTree), facade_(nullptr), depth_(0), tree_(names_)
+  {
+  }
+
+  void SubtreeCapture::Attach(ExpatFacade& facade, const std::string& path) {
+    facade_ = &facade;
+    depth_ = ExpatFacade::PathDepth(path);
+    facade.ListenFor(path, Tag().Subtree(*this));
+  }
+
+  void SubtreeCapture::Reset() {
+    open_.clear();
+  }
+
+  std::uint32_t SubtreeCapture::AddText(const char* s, size_t len) {
+    const std::uint32_t offset = (std::uint32_t) tree_.text_.size();
+    tree_.text_.append(s, len);
+    return offset;
+  }
+
+  void SubtreeCapture::StartElement(const char *name, const char **atts) {
+    // A new capture recycles the last tree's storage. The facade's depth (rather than
+    // open_) says where one starts, so an element cut short by a failed or stopped
+    // parse is dropped rather than becoming the parent of the next.
+    if (facade_->CurrentPath().depth == depth_) {
+      open_.clear();
+      tree_.nodes_.clear();
+      tree_.attributes_.clear();
+      tree_.text_.clear();
+    }
+
+    const std::uint32_t index = (std::uint32_t) tree_.nodes_.size();
+
+    CapturedTree::Node n;
+    n.name = (std::uint32_t) names_.Intern(name);
+    n.parent = open_.empty() ? CapturedTree::NO_NODE : open_.back().node;
+    n.firstChild = CapturedTree::NO_NODE;
+    n.nextSibling = CapturedTree::NO_NODE;
+    n.firstAttribute = (std::uint32_t) tree_.attributes_.size();
+    n.attributeCount = 0;
+    n.textOffset = 0;
+    n.textLength = 0;
+
+    for (; atts[0]; atts += 2) {
+      CapturedTree::Attribute a;
+      a.name = (std::uint32_t) names_.Intern(atts[0]);
+      a.length = (std::uint32_t) strlen(atts[1]);
+      a.offset = AddText(atts[1], a.length);
+
+      tree_.attributes_.push_back(a);
+      n.attributeCount++;
+    }
+
+    if (!open_.empty()) {
+      OpenNode& parent = open_.back();
+
+      if (parent.lastChild == CapturedTree::NO_NODE) {
+        tree_.nodes_[parent.node].firstChild = index;
+      }
+      else {
+        tree_.nodes_[parent.lastChild].nextSibling = index;
+      }
+
+      parent.lastChild = index;
+    }
+
+    tree_.nodes_.push_back(n);
+
+    OpenNode open = { index, CapturedTree::NO_NODE };
+    open_.push_back(open);
+
+    if (pendingText_.size() < open_.size()) {
+      pendingText_.resize(open_.size());
+    }
+    pendingText_[open_.size() - 1].clear();
+  }
+
+  void SubtreeCapture::EndElement(const char *name) {
+    // The element's text is gathered separately while it's open (its children's text
+    // is interleaved with it in the document) & only now copied to the tree, so each
+    // element's text is a single slice
+    if (open_.empty()) {
+      return;
+    }
+
+    std::string& text = pendingText_[open_.size() - 1];
+    CapturedTree::Node& n = tree_.nodes_[open_.back().node];
+
+    n.textLength = (std::uint32_t) text.size();
+    n.textOffset = AddText(text.data(), text.size());
+
+    open_.pop_back();
+
+    if (open_.empty()) {
+      onTree_(tree_);
+    }
+  }
+
+  void SubtreeCapture::CharacterData(const XML_Char *s, int len) {
+    if (!open_.empty()) {
+      pendingText_[open_.size() - 1].append(s, (size_t) len);
+    }
+  }
+
+} // james
@@ -0,0 +1,128 @@
+#pragma once
+
+#include <james/expat-facade.hpp>
+#include <james/expat-name-table.hpp>
+#include <james/expat-string-view.hpp>
+#include <cstdint>
+#include <functional>
+#include <string>
+#include <vector>
+
+namespace james {
+
+  //
+  // Read-only tree of one captured element & everything inside it.
+  //
+  // Nodes sit in one array in document order (the captured element is node 0) and
+  // link to each other by index. Names are ids in the capture's NameTable; each
+  // element's text (all the character data directly inside it, joined up) and its
+  // attribute values are slices of one text buffer.
+  //
+  struct CapturedTree {
+    static const std::uint32_t NO_NODE = 0xFFFFFFFF;
+
+    struct Node {
+      std::uint32_t name;         // NameTable id
+      std::uint32_t parent;       // NO_NODE for the root
+      std::uint32_t firstChild;   // NO_NODE when there are no child elements
+      std::uint32_t nextSibling;  // NO_NODE for the last child
+      std::uint32_t firstAttribute;
+      std::uint32_t attributeCount;
+      std::uint32_t textOffset;
+      std::uint32_t textLength;
+    };
+
+    struct Attribute {
+      std::uint32_t name;
+      std::uint32_t offset;
+      std::uint32_t length;
+    };
+
+    explicit CapturedTree(const NameTable& names) : names_(&names) {}
+
+    const Node& Root() const { return nodes_[0]; }
+    const Node& operator[](std::uint32_t i) const { return nodes_[i]; }
+    size_t Size() const { return nodes_.size(); }
+
+    const std::string& Name(const Node& n) const { return names_->Name(n.name); }
+    StringView Text(const Node& n) const { return StringView(text_.data() + n.textOffset, n.textLength); }
+
+    // Each returns nullptr when there's no such node
+    const Node* Parent(const Node& n) const { return At(n.parent); }
+    const Node* FirstChild(const Node& n) const { return At(n.firstChild); }
+    const Node* NextSibling(const Node& n) const { return At(n.nextSibling); }
+    const Node* Child(const Node& n, const char* name) const;
+
+    const Attribute* AttributesBegin(const Node& n) const { return attributes_.data() + n.firstAttribute; }
+    const Attribute* AttributesEnd(const Node& n) const { return attributes_.data() + n.firstAttribute + n.attributeCount; }
+    const Attribute* FindAttribute(const Node& n, const char* name) const;
+
+    const std::string& Name(const Attribute& a) const { return names_->Name(a.name); }
+    StringView Value(const Attribute& a) const { return StringView(text_.data() + a.offset, a.length); }
+
+  private:
+    friend struct SubtreeCapture;
+
+    const NameTable* names_;
+    std::vector<Node> nodes_;
+    std::vector<Attribute> attributes_;
+    std::string text_;
+
+    const Node* At(std::uint32_t i) const { return i == NO_NODE ? nullptr : &nodes_[i]; }
+  };
+
+  //
+  // Builds a CapturedTree for each element at a path & passes it to a callback,
+  // for consumers which need random access within a record.
+  //
+  //   SubtreeCapture capture([](const CapturedTree& tree) { ... });
+  //   capture.Attach(facade, "/feed/record");
+  //
+  // The tree's storage is reused from one record to the next (so once it has grown
+  // to fit the largest record capturing doesn't allocate) which means a tree is only
+  // valid until the callback returns. Attach each SubtreeCapture to a single path.
+  //
+  struct SubtreeCapture
+    : private ExpatParser::XMLConsumer
+  {
+    typedef std::function<void(const CapturedTree&)> TreeFunc;
+
+    explicit SubtreeCapture(TreeFunc onTree);
+
+    SubtreeCapture(const SubtreeCapture&) = delete;
+    SubtreeCapture& operator =(const SubtreeCapture&) = delete;
+
+    // Listens for path on facade (see Tag::Subtree). The capture must outlive the
+    // facade's parsing.
+    void Attach(ExpatFacade& facade, const std::string& path);
+
+    // Drops a partly captured element, e.g. after the parse it came from failed. (The
+    // next element at path does so anyway.)
+    void Reset();
+
+    const NameTable& Names() const { return names_; }
+
+  private:
+    TreeFunc onTree_;
+    const ExpatFacade* facade_;
+    int depth_;  // Of the elements at the attached path
+    NameTable names_;
+    CapturedTree tree_;
+
+    // For each open element: its node & its last child so far (to link the next one)
+    struct OpenNode {
+      std::uint32_t node;
+      std::uint32_t lastChild;
+    };
+
+    std::vector<OpenNode> open_;
+    std::vector<std::string> pendingText_;  // Per depth; kept to reuse their buffers
+
+    std::uint32_t AddText(const char* s, size_t len);
+
+    void StartElement(const char *name, const char **atts) override;
+    void EndElement(const char *name) override;
+    void CharacterData(const XML_Char *s, int len) override;
+  };
+
+} // james
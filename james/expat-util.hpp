@@ -0,0 +1,53 @@
+#pragma once
+
+// Helpers shared by the library's own .cpp files; not part of its interface.
+
+#include <cstddef>
+
+#if defined(__unix__) || defined(__APPLE__)
+#  define JAMES_HAVE_MMAP 1
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace james {
+
+  namespace detail {
+    // XML's whitespace (the S production)
+    inline bool IsSpace(char c) {
+      return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+    }
+
+  #ifdef JAMES_HAVE_MMAP
+
+    struct FileDescriptor {
+      int fd;
+
+      explicit FileDescriptor(int fd) : fd(fd) {}
+      ~FileDescriptor() { if (fd >= 0) { close(fd); } }
+
+      FileDescriptor(const FileDescriptor&) = delete;
+      FileDescriptor& operator =(const FileDescriptor&) = delete;
+    };
+
+    // A read only view of length bytes of the file from offset (a multiple of the
+    // page size); data is MAP_FAILED if mmap failed
+    struct MappedWindow {
+      void* data;
+      std::size_t length;
+
+      MappedWindow(int fd, off_t offset, std::size_t length)
+        : data(mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, offset)), length(length)
+      {}
+      ~MappedWindow() { if (data != MAP_FAILED) { munmap(data, length); } }
+
+      MappedWindow(const MappedWindow&) = delete;
+      MappedWindow& operator =(const MappedWindow&) = delete;
+    };
+
+  #endif
+  }
+
+} // james
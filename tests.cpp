@@ -0,0 +1,399 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <cstdio>
+
+#include <james/expat-parser.hpp>
+#include <james/expat-parser-pool.hpp>
+#include <james/expat-basic-parser.hpp>
+#include <james/expat-facade.hpp>
+#include <james/expat-binding.hpp>
+#include <james/expat-subtree-capture.hpp>
+#include <james/expat-parse-scheduler.hpp>
+#include <james/expat-parallel-parse.hpp>
+
+using namespace james;
+using namespace std;
+
+//
+// Behaviour checks for the library. Each check that fails is reported & the program
+// exits non-zero.
+//
+
+int failures = 0;
+
+#define CHECK(cond) \
+  do { \
+    if (!(cond)) { \
+      cerr << __FILE__ << ":" << __LINE__ << ": CHECK(" #cond ") failed\n"; \
+      ++failures; \
+    } \
+  } while (false)
+
+// The spellings of a path ListenFor accepts
+const char* const RECORD_PATHS[] = { "/feed/trade", "feed/trade", "/feed/trade/" };
+
+const char* const FEED =
+  "<feed>"
+  "<trade id=\"1\"><symbol>AB<x/>C</symbol><price>\n  1.5\n</price></trade>"
+  "<trade id=\"2\"><price>2</price><other><symbol>no</symbol></other></trade>"
+  "</feed>";
+
+// Builds a document of count records, big enough to span several reads & windows
+string RecordsDocument(int count) {
+  ostringstream xml;
+  xml << "<?xml version=\"1.0\"?>\n<!DOCTYPE root [<!ENTITY e \"entity text\">]>\n<root>\n";
+  for (int i = 0; i < count; ++i) {
+    xml << "  <record id=\"" << i << "\">text " << i << " &e; <b>bold</b> tail</record>\n";
+  }
+  xml << "</root>\n";
+  return xml.str();
+}
+
+void WriteFile(const string& path, const string& contents) {
+  ofstream dst(path, ios::out | ios::binary);
+  dst << contents;
+}
+
+// Writes every event to a string, so the same document parsed different ways can be
+// compared. Runs of text are joined whichever chunks Expat delivers them in.
+struct Recorder
+  : ExpatParser::XMLConsumer
+{
+  string events;
+
+  void StartElement(const char *name, const char **atts) override {
+    events += "<";
+    events += name;
+    for (; atts[0]; atts += 2) {
+      events += string(" ") + atts[0] + "=" + atts[1];
+    }
+    events += ">";
+  }
+
+  void EndElement(const char *name) override {
+    events += string("</") + name + ">";
+  }
+
+  void CharacterData(const XML_Char *s, int len) override {
+    events.append(s, len);
+  }
+};
+
+//
+// Bind
+//
+
+struct Trade {
+  long long id;
+  string symbol;
+  double price;
+};
+
+void TestBindPaths() {
+  for (const char* path : RECORD_PATHS) {
+    vector<Trade> trades;
+
+    ExpatFacade facade;
+    Bind<Trade>(path)
+      .Attr("id", &Trade::id)
+      .Text("symbol", &Trade::symbol)
+      .Text("price", &Trade::price)
+      .Attach(facade, [&](const Trade& t) { trades.push_back(t); });
+
+    ExpatParser parser(facade.XMLConsumer());
+    parser.Parse(FEED);
+
+    CHECK(trades.size() == 2);
+    if (trades.size() == 2) {
+      CHECK(trades[0].id == 1 && trades[0].symbol == "ABC" && trades[0].price == 1.5);
+      CHECK(trades[1].id == 2 && trades[1].symbol.empty() && trades[1].price == 2);
+    }
+  }
+}
+
+void TestBindErrors() {
+  // Attributes follow Attributes::GetInt (no surrounding space); text may be padded
+  const char* const invalid[] = {
+    "<feed><trade id=\" 5\"/></feed>",
+    "<feed><trade><price>1 2</price></trade></feed>",
+    "<feed><trade><price>1e400</price></trade></feed>",
+  };
+
+  for (const char* xml : invalid) {
+    ExpatFacade facade;
+    Bind<Trade>("/feed/trade")
+      .Attr("id", &Trade::id)
+      .Text("price", &Trade::price)
+      .Attach(facade, [](const Trade&) {});
+
+    ExpatParser parser(facade.XMLConsumer());
+    bool threw = false;
+
+    try {
+      parser.Parse(xml);
+    }
+    catch (const runtime_error&) {
+      threw = true;
+    }
+    CHECK(threw);
+  }
+}
+
+//
+// SubtreeCapture
+//
+
+void TestCapturePaths() {
+  for (const char* path : RECORD_PATHS) {
+    vector<size_t> sizes;
+
+    SubtreeCapture capture([&](const CapturedTree& tree) {
+      sizes.push_back(tree.Size());
+      CHECK(tree.Name(tree.Root()) == "trade");
+    });
+
+    ExpatFacade facade;
+    capture.Attach(facade, path);
+
+    // A parse which fails part way through a record must not leave it open
+    {
+      ExpatParser parser(facade.XMLConsumer());
+      try {
+        parser.Parse("<feed><trade id=\"1\"><symbol>", false);
+        parser.Parse("<<", true);
+      }
+      catch (const ExpatParser::Exception&) {
+      }
+    }
+    facade.Reset();
+
+    ExpatParser parser(facade.XMLConsumer());
+    parser.Parse(FEED);
+
+    CHECK(sizes.size() == 2);
+    if (sizes.size() == 2) {
+      CHECK(sizes[0] == 4);  // trade, symbol, x, price
+      CHECK(sizes[1] == 4);  // trade, price, other, symbol
+    }
+  }
+}
+
+//
+// ParseScheduler
+//
+
+void TestSchedulerErrors() {
+  ParseScheduler scheduler([](const ParseScheduler::Document& d) {
+    unique_ptr<ExpatParser::XMLConsumer> consumer;
+    if (d.name == "throws") {
+      throw runtime_error("factory failed");
+    }
+    if (d.name != "null") {
+      consumer.reset(new Recorder());
+    }
+    return consumer;
+  }, 3);
+
+  scheduler.AddBuffer("<a>x</a>", "good");
+  scheduler.AddBuffer("<a/>", "null");
+  scheduler.AddBuffer("<a>", "malformed");
+  scheduler.AddBuffer("<a/>", "throws");
+  scheduler.AddFile("this file does not exist.xml");
+  scheduler.AddBuffer("<b>y</b>", "good too");
+
+  ParseScheduler::Stats stats;
+  vector<ParseScheduler::Result> results = scheduler.Run(&stats);
+
+  CHECK(results.size() == 6);
+  CHECK(stats.documents == 6 && stats.failed == 4);
+
+  if (results.size() == 6) {
+    CHECK(!results[0].error && static_cast<Recorder&>(*results[0].consumer).events == "<a>x</a>");
+    CHECK(results[1].error && !results[1].consumer);
+    CHECK(results[2].error);
+    CHECK(results[3].error);
+    CHECK(results[4].error);
+    CHECK(!results[5].error && static_cast<Recorder&>(*results[5].consumer).events == "<b>y</b>");
+  }
+}
+
+//
+// Arena
+//
+
+void TestArenaExhaustion() {
+  const string xml = RecordsDocument(2000);
+
+  ExpatFacade facade;
+  ExpatParser parser(facade.XMLConsumer(), ExpatParser::ArenaOptions(16 * 1024, 4096));
+  bool outOfMemory = false;
+
+  try {
+    parser.Parse(xml);
+  }
+  catch (const ExpatParser::Exception& e) {
+    outOfMemory = e.Code() == XML_ERROR_NO_MEMORY;
+  }
+  CHECK(outOfMemory);
+
+  // The arena is released by Reset, so a small document still fits
+  Recorder recorder;
+  parser.Reset(recorder);
+  parser.Parse("<a>small</a>");
+  CHECK(recorder.events == "<a>small</a>");
+}
+
+void TestArenaReuse() {
+  const string xml = RecordsDocument(500);
+
+  Recorder plain;
+  ExpatParser(plain).Parse(xml);
+
+  Recorder arena;
+  ExpatParser parser(arena, ExpatParser::ArenaOptions(0, 1024));
+
+  for (int i = 0; i < 3; ++i) {
+    arena.events.clear();
+    parser.Reset();
+    parser.Parse(xml);
+    CHECK(arena.events == plain.events);
+  }
+}
+
+//
+// ParseStream, ParseStreamPipelined & ParseFile
+//
+
+void TestReadersAgree() {
+  const string xml = RecordsDocument(3000);
+  const string path = "expat-wrapper-tests.xml";
+  WriteFile(path, xml);
+
+  Recorder expected;
+  ExpatParser(expected).Parse(xml);
+
+  {
+    Recorder r;
+    ExpatParser parser(r);
+    istringstream src(xml);
+    ParseStream(parser, src, 512, 4096);
+    CHECK(r.events == expected.events);
+  }
+
+  {
+    Recorder r;
+    ExpatParser parser(r);
+    istringstream src(xml);
+    ParseStreamPipelined(parser, src, 1000, 3);
+    CHECK(r.events == expected.events);
+  }
+
+  {
+    // Small windows so the file is mapped in several pieces
+    Recorder r;
+    ExpatParser parser(r);
+    ParseFile(parser, path, 4096);
+    CHECK(r.events == expected.events);
+  }
+
+  remove(path.c_str());
+}
+
+//
+// Parser lifetimes
+//
+
+void TestPoolOutlivesConsumers() {
+  ExpatParserPool pool;
+
+  for (int i = 0; i < 3; ++i) {
+    Recorder r;
+    ExpatParserPool::Handle parser = pool.Acquire(r);
+    parser->Parse("<a/>");
+    CHECK(r.events == "<a></a>");
+  }
+
+  CHECK(pool.IdleCount() == 1);
+}
+
+void TestParallelParse() {
+  const string path = "expat-wrapper-tests-parallel.xml";
+  WriteFile(path, RecordsDocument(2000));
+
+  long long sum = 0;
+  int records = 0;
+
+  ParallelParseFile(path, ParallelParseOptions("record", 2, 4096), [&](ExpatFacade& facade) {
+    auto ids = make_shared<vector<long long>>();
+
+    facade.ListenFor("/root/record", Tag().Opened([ids](const Path&, const Attributes& atts) {
+      long long id = 0;
+      atts.GetInt("id", id);
+      ids->push_back(id);
+    }));
+
+    return ChunkDeliverFunc([ids, &sum, &records]() {
+      for (long long id : *ids) {
+        sum += id;
+        ++records;
+      }
+    });
+  });
+
+  CHECK(records == 2000);
+  CHECK(sum == 1999LL * 2000 / 2);
+
+  remove(path.c_str());
+}
+
+//
+// BasicExpatParser
+//
+
+void TestBasicParserExpandsEntities() {
+  Recorder r;
+  BasicExpatParser<Recorder> parser(r);
+  parser.Parse("<!DOCTYPE a [<!ENTITY e \"expanded\">]><a>x&e;y</a>");
+  CHECK(r.events == "<a>xexpandedy</a>");
+}
+
+//
+// Attributes
+//
+
+void TestTypedAttributes() {
+  const char* data[] = { "d", "1.5", "big", "1e400", "tiny", "1e-400", "i", " 5", nullptr };
+  Attributes atts(data);
+
+  double d = 0;
+  CHECK(atts.GetDouble("d", d) && d == 1.5);
+  CHECK(!atts.GetDouble("big", d) && d == 1.5);
+  CHECK(atts.GetDouble("tiny", d) && d < 1e-300);
+
+  int i = 7;
+  CHECK(!atts.GetInt("i", i) && i == 7);
+}
+
+int main() {
+  TestBindPaths();
+  TestBindErrors();
+  TestCapturePaths();
+  TestSchedulerErrors();
+  TestArenaExhaustion();
+  TestArenaReuse();
+  TestReadersAgree();
+  TestPoolOutlivesConsumers();
+  TestParallelParse();
+  TestBasicParserExpandsEntities();
+  TestTypedAttributes();
+
+  if (failures) {
+    cerr << failures << " check(s) failed\n";
+    return 1;
+  }
+
+  cout << "All checks passed\n";
+  return 0;
+}